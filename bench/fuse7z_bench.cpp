@@ -0,0 +1,565 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * End-to-end benchmark: generates synthetic archives, mounts them in-process
+ * by calling the fuse7z_* callbacks directly (no kernel, no libfuse) and
+ * prints one JSON object per archive on stdout.
+ *
+ * tar archives are written by the benchmark itself. The 7z and zip variants
+ * (solid or not, stored or compressed) need a 7z command in the PATH and are
+ * skipped without one. lib7zip still needs 7z.so, see README.
+ *
+ * usage: fuse7z_bench [--scale=PERCENT] [--dir=DIR] [--keep] [--generate-only]
+ */
+#include "fuse_functions.h"
+#include "logger.h"
+#include "options.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+/*
+ * The callbacks find their Fuse7z through fuse_get_context(), which libfuse
+ * only sets up while it serves a request. The benchmark doesn't link libfuse
+ * and provides the context itself.
+ */
+static struct fuse_context bench_context;
+
+struct fuse_context *
+fuse_get_context (void)
+{
+    return &bench_context;
+}
+
+struct File
+{
+    std::string path;
+    unsigned long long size;
+};
+
+struct Dataset
+{
+    char const * name;
+    std::vector<File> files;
+};
+
+struct Format
+{
+    char const * name;
+    // arguments of "7z a", nullptr for the tar written here
+    char const * args;
+    char const * extension;
+};
+
+static double
+seconds_since (bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static uint64_t
+xorshift (uint64_t & state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * Deterministic content, compressible about like text.
+ */
+static void
+fill (std::vector<char> & buf, uint64_t & state)
+{
+    static char const alphabet[] = "etaoinshrdlucmfw        \n";
+    for (size_t i = 0; i < buf.size(); i += 8) {
+        uint64_t r = xorshift(state);
+        for (size_t j = i; j < i + 8 && j < buf.size(); ++j, r >>= 8) {
+            buf[j] = alphabet[(r & 0xff) % (sizeof(alphabet) - 1)];
+        }
+    }
+}
+
+static Dataset
+tiny_files (unsigned scale)
+{
+    // many small files spread over a hundred directories
+    Dataset d = { "tiny", {} };
+    unsigned count = 20000 * scale / 100;
+    for (unsigned i = 0; i < count; ++i) {
+        d.files.push_back({ "dir" + std::to_string(i % 100) + "/file" + std::to_string(i), 64 + i % 4000 });
+    }
+    return d;
+}
+
+static Dataset
+deep_tree (unsigned scale)
+{
+    // 64 levels of directories, a few files at each level
+    Dataset d = { "deep", {} };
+    unsigned per_level = std::max(1u, 16 * scale / 100);
+    std::string dir;
+    for (int depth = 0; depth < 64; ++depth) {
+        dir += (depth ? "/level" : "level") + std::to_string(depth);
+        for (unsigned i = 0; i < per_level; ++i) {
+            d.files.push_back({ dir + "/file" + std::to_string(i), 1024 });
+        }
+    }
+    return d;
+}
+
+static Dataset
+huge_file (unsigned scale)
+{
+    Dataset d = { "huge", {} };
+    d.files.push_back({ "huge.bin", (256ULL << 20) * scale / 100 });
+    return d;
+}
+
+static void
+tar_octal (char * field, size_t size, unsigned long long value)
+{
+    snprintf(field, size, "%0*llo", (int)size - 1, value);
+}
+
+static void
+tar_header (FILE * out, std::string const & name, unsigned long long size, char type)
+{
+    char h[512];
+    memset(h, 0, sizeof(h));
+    memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+    tar_octal(h + 100, 8, 0644);
+    tar_octal(h + 108, 8, 0);
+    tar_octal(h + 116, 8, 0);
+    if (size < (1ULL << 33)) {
+        tar_octal(h + 124, 12, size);
+    }
+    else {
+        // GNU base-256
+        h[124] = (char)0x80;
+        for (int i = 11; i > 3; --i, size >>= 8) {
+            h[124 + i] = (char)(size & 0xff);
+        }
+    }
+    tar_octal(h + 136, 12, 1500000000);
+    h[156] = type;
+    memcpy(h + 257, "ustar  ", 8);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); ++i) {
+        sum += (unsigned char)h[i];
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    fwrite(h, 1, sizeof(h), out);
+}
+
+static void
+tar_pad (FILE * out, unsigned long long size)
+{
+    static char const zeros[512] = {};
+    fwrite(zeros, 1, (512 - size % 512) % 512, out);
+}
+
+static void
+write_tar (Dataset const & d, std::string const & path)
+{
+    FILE * out = fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        throw std::runtime_error("can't create " + path);
+    }
+    std::vector<char> buf(1 << 20);
+    uint64_t state = 88172645463325252ULL;
+    for (File const & f : d.files) {
+        if (f.path.size() >= 100) {
+            // GNU long name
+            tar_header(out, "././@LongLink", f.path.size() + 1, 'L');
+            fwrite(f.path.c_str(), 1, f.path.size() + 1, out);
+            tar_pad(out, f.path.size() + 1);
+        }
+        tar_header(out, f.path, f.size, '0');
+        for (unsigned long long done = 0; done < f.size; ) {
+            size_t n = std::min<unsigned long long>(buf.size(), f.size - done);
+            buf.resize(n);
+            fill(buf, state);
+            fwrite(buf.data(), 1, n, out);
+            done += n;
+        }
+        buf.resize(1 << 20);
+        tar_pad(out, f.size);
+    }
+    static char const end[1024] = {};
+    fwrite(end, 1, sizeof(end), out);
+    if (fclose(out) != 0) {
+        throw std::runtime_error("can't write " + path);
+    }
+}
+
+static void
+write_tree (Dataset const & d, std::string const & root)
+{
+    std::vector<char> buf(1 << 20);
+    uint64_t state = 88172645463325252ULL;
+    for (File const & f : d.files) {
+        std::string path = root + "/" + f.path;
+        for (size_t slash = root.size() + 1; (slash = path.find('/', slash)) != std::string::npos; ++slash) {
+            mkdir(path.substr(0, slash).c_str(), 0755);
+        }
+        FILE * out = fopen(path.c_str(), "wb");
+        if (out == nullptr) {
+            throw std::runtime_error("can't create " + path);
+        }
+        for (unsigned long long done = 0; done < f.size; ) {
+            size_t n = std::min<unsigned long long>(buf.size(), f.size - done);
+            buf.resize(n);
+            fill(buf, state);
+            fwrite(buf.data(), 1, n, out);
+            done += n;
+        }
+        buf.resize(1 << 20);
+        fclose(out);
+    }
+}
+
+static std::string
+find_7z ()
+{
+    char const * names[] = { "7z", "7za", "7zz" };
+    for (char const * name : names) {
+        std::string cmd = std::string("command -v ") + name + " >/dev/null 2>&1";
+        if (system(cmd.c_str()) == 0) {
+            return name;
+        }
+    }
+    return "";
+}
+
+static int
+fill_count (void * buf, const char *, const struct stat *, off_t)
+{
+    ++*static_cast<unsigned long long *>(buf);
+    return 0;
+}
+
+static double
+percentile (std::vector<double> & values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * (double) values.size()))];
+}
+
+/**
+ * Read a whole file through the callbacks.
+ * @return the bytes read
+ */
+static unsigned long long
+read_file (std::string const & path, std::vector<char> & buf)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (fuse7z_open(path.c_str(), &fi) != 0) {
+        throw std::runtime_error("open failed: " + path);
+    }
+    unsigned long long total = 0;
+    int n;
+    while ((n = fuse7z_read(path.c_str(), buf.data(), buf.size(), total, &fi)) > 0) {
+        total += n;
+    }
+    fuse7z_release(path.c_str(), &fi);
+    if (n < 0) {
+        throw std::runtime_error("read failed: " + path);
+    }
+    return total;
+}
+
+/**
+ * Mount the archive in-process, run the measures and print the result.
+ */
+static void
+measure (Dataset const & d, Format const & format, std::string const & archive, std::string const & dir)
+{
+    struct stat st;
+    stat(archive.c_str(), &st);
+
+    Fuse7zOptions options;
+    bench_clock::time_point start = bench_clock::now();
+    void * data = fuse7z_initlib(archive.c_str(), dir.c_str(), options);
+    double index_ms = seconds_since(start) * 1000;
+    bench_context.private_data = data;
+
+    std::vector<std::string> paths;
+    std::set<std::string> dirs;
+    dirs.insert("/");
+    for (File const & f : d.files) {
+        paths.push_back("/" + f.path);
+        for (size_t slash = 1; (slash = paths.back().find('/', slash)) != std::string::npos; ++slash) {
+            dirs.insert(paths.back().substr(0, slash));
+        }
+    }
+
+    // getattr: at least 200000 calls over every path
+    size_t calls = 0;
+    start = bench_clock::now();
+    while (calls < 200000) {
+        for (std::string const & p : paths) {
+            struct stat attr;
+            if (fuse7z_getattr(p.c_str(), &attr) != 0) {
+                throw std::runtime_error("getattr failed: " + p);
+            }
+        }
+        calls += paths.size();
+    }
+    double getattr_ops = (double) calls / seconds_since(start);
+
+    // readdir: every directory, at least 2000 listings
+    size_t listings = 0;
+    unsigned long long entries = 0;
+    start = bench_clock::now();
+    while (listings < 2000) {
+        for (std::string const & p : dirs) {
+            struct fuse_file_info fi;
+            memset(&fi, 0, sizeof(fi));
+            fuse7z_opendir(p.c_str(), &fi);
+            fuse7z_readdir(p.c_str(), &entries, fill_count, 0, &fi);
+            fuse7z_releasedir(p.c_str(), &fi);
+        }
+        listings += dirs.size();
+    }
+    double readdir_seconds = seconds_since(start);
+
+    // open to first 4 KiB, on up to 200 files spread over the archive
+    std::vector<char> buf(128 << 10);
+    std::vector<double> open_us;
+    size_t step = std::max<size_t>(1, paths.size() / 200);
+    for (size_t i = 0; i < paths.size(); i += step) {
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        start = bench_clock::now();
+        if (fuse7z_open(paths[i].c_str(), &fi) != 0
+                || fuse7z_read(paths[i].c_str(), buf.data(), 4096, 0, &fi) < 0) {
+            throw std::runtime_error("open failed: " + paths[i]);
+        }
+        open_us.push_back(seconds_since(start) * 1e6);
+        fuse7z_release(paths[i].c_str(), &fi);
+    }
+
+    // sequential: the files in archive order, up to 256 MiB
+    unsigned long long seq_bytes = 0;
+    start = bench_clock::now();
+    for (size_t i = 0; i < paths.size() && seq_bytes < (256ULL << 20); ++i) {
+        seq_bytes += read_file(paths[i], buf);
+    }
+    double seq_seconds = seconds_since(start);
+
+    // random: 4 KiB reads in the largest file, once opened
+    size_t largest = 0;
+    for (size_t i = 0; i < d.files.size(); ++i) {
+        if (d.files[i].size > d.files[largest].size) {
+            largest = i;
+        }
+    }
+    unsigned long long rand_bytes = 0;
+    double rand_seconds = 0;
+    if (d.files[largest].size >= 4096) {
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        char const * path = paths[largest].c_str();
+        if (fuse7z_open(path, &fi) != 0) {
+            throw std::runtime_error(std::string("open failed: ") + path);
+        }
+        uint64_t state = 2463534242ULL;
+        start = bench_clock::now();
+        for (int i = 0; i < 4000; ++i) {
+            off_t offset = xorshift(state) % (d.files[largest].size - 4096 + 1);
+            int n = fuse7z_read(path, buf.data(), 4096, offset, &fi);
+            if (n < 0) {
+                throw std::runtime_error(std::string("read failed: ") + path);
+            }
+            rand_bytes += n;
+        }
+        rand_seconds = seconds_since(start);
+        fuse7z_release(path, &fi);
+    }
+
+    fuse7z_destroy(data);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"dataset\":\"%s\",\"format\":\"%s\",\"files\":%zu,\"archive_bytes\":%lld,"
+           "\"index_ms\":%.1f,\"peak_rss_kb\":%ld,\"getattr_ops\":%.0f,"
+           "\"readdir_ops\":%.0f,\"readdir_entries\":%.0f,"
+           "\"open_us_p50\":%.1f,\"open_us_p90\":%.1f,\"open_us_p99\":%.1f,"
+           "\"seq_mbps\":%.1f,\"rand_mbps\":%.1f}\n",
+           d.name, format.name, d.files.size(), (long long)st.st_size,
+           index_ms, usage.ru_maxrss, getattr_ops,
+           (double) listings / readdir_seconds, (double) entries / readdir_seconds,
+           percentile(open_us, 0.5), percentile(open_us, 0.9), percentile(open_us, 0.99),
+           (double) seq_bytes / seq_seconds / 1e6, rand_seconds > 0 ? (double) rand_bytes / rand_seconds / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+int
+main (int argc, char ** argv)
+{
+    unsigned scale = 100;
+    std::string dir;
+    bool keep = false;
+    bool generate_only = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--scale=", 8) == 0) {
+            scale = std::max(1, atoi(argv[i] + 8));
+        }
+        else if (strncmp(argv[i], "--dir=", 6) == 0) {
+            dir = argv[i] + 6;
+        }
+        else if (strcmp(argv[i], "--keep") == 0) {
+            keep = true;
+        }
+        else if (strcmp(argv[i], "--generate-only") == 0) {
+            generate_only = keep = true;
+        }
+        else {
+            fprintf(stderr, "usage: %s [--scale=PERCENT] [--dir=DIR] [--keep] [--generate-only]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (dir.empty()) {
+        char const * tmp = getenv("TMPDIR");
+        std::string pattern = std::string(tmp ? tmp : "/tmp") + "/fuse7z_bench.XXXXXX";
+        if (mkdtemp(&pattern[0]) == nullptr) {
+            perror("mkdtemp");
+            return 1;
+        }
+        dir = pattern;
+    }
+    else {
+        mkdir(dir.c_str(), 0755);
+    }
+
+    Logger::setLevel(Logger::L_WARNING);
+
+    std::string sevenzip = find_7z();
+    if (sevenzip.empty()) {
+        fprintf(stderr, "no 7z command found, only the tar archives are generated\n");
+    }
+
+    static Format const tar = { "tar", nullptr, "tar" };
+    static Format const solid = { "7z-solid", "-t7z -mx=1 -ms=on", "7z" };
+    static Format const nonsolid = { "7z-nonsolid", "-t7z -mx=1 -ms=off", "7z" };
+    static Format const store = { "7z-store", "-t7z -mx=0", "7z" };
+    static Format const zip_store = { "zip-store", "-tzip -mx=0", "zip" };
+    static Format const zip_deflate = { "zip-deflate", "-tzip -mx=1", "zip" };
+
+    struct Case
+    {
+        Dataset data;
+        std::vector<Format const *> formats;
+    };
+    std::vector<Case> cases = {
+        { tiny_files(scale), { &tar, &solid, &nonsolid, &zip_store } },
+        { deep_tree(scale), { &tar, &nonsolid } },
+        { huge_file(scale), { &tar, &store, &solid, &zip_deflate } },
+    };
+
+    int status = 0;
+    for (Case const & c : cases) {
+        std::string tree = dir + "/" + c.data.name;
+        bool have_tree = false;
+        for (Format const * format : c.formats) {
+            std::string archive = dir + "/" + c.data.name + "-" + format->name + "." + format->extension;
+            try {
+                if (format->args == nullptr) {
+                    write_tar(c.data, archive);
+                }
+                else if (sevenzip.empty()) {
+                    continue;
+                }
+                else {
+                    if (!have_tree) {
+                        mkdir(tree.c_str(), 0755);
+                        write_tree(c.data, tree);
+                        have_tree = true;
+                    }
+                    std::string cmd = "cd '" + tree + "' && " + sevenzip + " a -bd -y " + format->args
+                        + " '" + archive + "' . >/dev/null";
+                    if (system(cmd.c_str()) != 0) {
+                        throw std::runtime_error("7z failed: " + cmd);
+                    }
+                }
+            }
+            catch (std::exception & e) {
+                fprintf(stderr, "%s\n", e.what());
+                status = 1;
+                continue;
+            }
+            if (generate_only) {
+                fprintf(stderr, "generated %s\n", archive.c_str());
+                continue;
+            }
+
+            // one process per archive, so that the peak RSS is its own
+            pid_t pid = fork();
+            if (pid == 0) {
+                try {
+                    measure(c.data, *format, archive, dir);
+                    _exit(0);
+                }
+                catch (std::exception & e) {
+                    printf("{\"dataset\":\"%s\",\"format\":\"%s\",\"error\":\"%s\"}\n",
+                           c.data.name, format->name, e.what());
+                    fflush(stdout);
+                    _exit(1);
+                }
+            }
+            int child = 1;
+            if (pid < 0 || waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+                status = 1;
+            }
+            if (!keep) {
+                unlink(archive.c_str());
+            }
+        }
+        if (have_tree && !keep) {
+            std::string cmd = "rm -rf '" + tree + "'";
+            if (system(cmd.c_str()) != 0) {
+                status = 1;
+            }
+        }
+    }
+    if (!keep) {
+        rmdir(dir.c_str());
+    }
+    return status;
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Path lookup throughput on synthetic trees: component walk (Node::find)
+ * against the full path hash table (NodeTree::find).
+ */
+#include "node.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+template<typename F>
+static double
+ops_per_second (std::vector<std::string> const & paths, unsigned rounds, F lookup)
+{
+    size_t found = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            found += lookup(paths[i].c_str()) != nullptr;
+        }
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    if (found != paths.size() * rounds) {
+        fprintf(stderr, "lookup mismatch: %zu of %zu\n", found, paths.size() * rounds);
+    }
+    return (double) (paths.size() * rounds) / seconds;
+}
+
+static void
+run (char const * name, NodeTree & tree, std::vector<std::string> const & paths, unsigned rounds)
+{
+    Node * root = tree.root();
+    double walk = ops_per_second(paths, rounds, [root] (char const * p) { return root->find(p); });
+    double hash = ops_per_second(paths, rounds, [&tree] (char const * p) { return tree.find(p); });
+    printf("%-6s nodes=%-8zu index_bytes=%-10zu walk=%.0f/s hash=%.0f/s\n",
+           name, tree.size(), tree.memory(), walk, hash);
+}
+
+int
+main ()
+{
+    {
+        // 64 levels of directories, 16 files at each level
+        NodeTree tree;
+        std::vector<std::string> paths;
+        std::string dir;
+        for (int depth = 0; depth < 64; ++depth) {
+            dir += (depth ? "/level" : "level") + std::to_string(depth);
+            for (int i = 0; i < 16; ++i) {
+                paths.push_back(dir + "/file" + std::to_string(i));
+                tree.insert(paths.back().c_str());
+            }
+        }
+        tree.finalize();
+        run("deep", tree, paths, 200);
+    }
+    {
+        // 200000 files in a single directory
+        NodeTree tree;
+        std::vector<std::string> paths;
+        for (int i = 0; i < 200000; ++i) {
+            paths.push_back("wide/file" + std::to_string(i));
+            tree.insert(paths.back().c_str());
+        }
+        tree.finalize();
+        run("wide", tree, paths, 5);
+    }
+    return 0;
+}
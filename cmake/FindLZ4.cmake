@@ -0,0 +1,22 @@
+# Find the liblz4 includes and library
+#
+#  LZ4_INCLUDE_DIR - where to find lz4.h
+#  LZ4_LIBRARIES   - List of libraries when using liblz4.
+#  LZ4_FOUND       - True if liblz4 is found.
+
+# check if already in cache, be silent
+if (LZ4_INCLUDE_DIR)
+        SET (LZ4_FIND_QUIETLY TRUE)
+endif (LZ4_INCLUDE_DIR)
+
+# find includes
+find_path (LZ4_INCLUDE_DIR lz4.h)
+
+# find lib
+find_library (LZ4_LIBRARIES NAMES lz4 liblz4)
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("LZ4" DEFAULT_MSG
+    LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+
+mark_as_advanced (LZ4_INCLUDE_DIR LZ4_LIBRARIES)
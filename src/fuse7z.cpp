@@ -16,17 +16,35 @@
  */
 #include "fuse7z.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include <Windows.h>
+#endif
+
 // move the implementation here
-Fuse7z::Fuse7z(std::string const & filename, std::string const & cwd) :
-         stream (filename),
-         archive_fn (filename),
-         cwd (cwd)
+Fuse7z::Fuse7z(std::string const & source, std::string const & cwd, Fuse7zOptions const & options) :
+         options (options),
+         cache (options),
+         multi (false),
+         open_memory (0),
+         use_count (0),
+         archive_fn (source),
+         cwd (cwd),
+         keep_cache (options.cache_policy == CACHE_KERNEL),
+         cache_timeout (options.cache_policy == CACHE_KERNEL ? options.cache_timeout : 0)
 {
-    root_node = new Node(nullptr, "");
-    root_node->is_dir = true;
-
-    Logger &logger = Logger::instance ();
-    logger << "Initialization of fuse-7z with archive " << filename << Logger::endl;
+    LOG(INFO) << "Initialization of fuse-7z with archive " << source << Logger::endl;
     
     if (!lib.Initialize()) {
         throw std::runtime_error("7z library initialization failed. Is the 7z.so/7z.dll folder in LD_LIBRARY_PATH?");
@@ -40,114 +58,764 @@ Fuse7z::Fuse7z(std::string const & filename, std::string const & cwd) :
     }
 
 
-    logger << "Supported extensions : ";
-    size_t size = exts.size();
-    for(size_t i = 0; i < size; i++) {
-        std::wstring ext = exts[i];
+    if (Logger::enabled(Logger::L_DEBUG)) {
+        std::string names;
+        size_t size = exts.size();
+        for(size_t i = 0; i < size; i++) {
+            std::wstring ext = exts[i];
+            for(size_t j = 0; j < ext.size(); j++) {
+                names += (char)(ext[j] &0xFF);
+            }
+            names += " ";
+        }
+        LOG(DEBUG) << "Supported extensions : " << names << Logger::endl;
+    }
+
+    // the archives are opened after fuse changed the working directory
+    std::string path = source;
+    if (path.empty() || path[0] != '/') {
+        path = cwd + "/" + path;
+    }
+    struct stat st;
+    multi = options.archive_list || (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+    if (multi) {
+        list(path, !options.archive_list);
+        if (slots.empty()) {
+            throw std::runtime_error("No archive found in " + source);
+        }
+        mounts.finalize();
+        mount_slots.resize(mounts.size() + 1, nullptr);
+        for (ArchiveSlot * slot : slots) {
+            mount_slots[slot->mount->ino] = slot;
+        }
+        root_node = mounts.root();
+        LOG(INFO) << "Serving " << slots.size() << " archives, opened on first use" << Logger::endl;
+    }
+    else {
+        add(path, std::string());
+        ArchiveSlot * slot = slots[0];
+        slot->archive = new Fuse7zArchive(lib, path, slot->serial, options, cache, stats, node_mutex,
+                ArchivePool::open_t(), options.background_index);
+        slot->memory = slot->archive->memory();
+        open_memory = slot->memory;
+        root_node = slot->archive->root();
+    }
+
+    // inodes the trees never hand out
+    memset(&control_dir, 0, sizeof(control_dir));
+    control_dir.name = ".fuse7z";
+    control_dir.parent = root_node;
+    control_dir.childs = control_childs;
+    control_dir.child_count = 1;
+    control_dir.ino = UINT_MAX - 1;
+    control_dir.id = Node::NEW_NODE_INDEX;
+    control_dir.block = -1;
+    control_dir.is_dir = true;
+    memset(&control_file, 0, sizeof(control_file));
+    control_file.name = "stats";
+    control_file.parent = &control_dir;
+    control_file.ino = UINT_MAX;
+    control_file.id = Node::NEW_NODE_INDEX;
+    control_file.block = -1;
+    control_childs[0] = &control_file;
+}
+
+void Fuse7z::start() {
+    if (!multi) {
+        slots[0]->archive->start();
+    }
+}
 
+Fuse7z::~Fuse7z() {
+    std::vector<ArchiveSlot *> all(slots);
+    for (auto & i : inner_slots) {
+        all.push_back(i.second);
+    }
 
-        for(size_t j = 0; j < ext.size(); j++) {
-            logger << (char)(ext[j] &0xFF);
+    // stops the running extractions before the archives go away
+    for (ArchiveSlot * slot : all) {
+        if (slot->archive != nullptr) {
+            slot->archive->stop();
         }
-        logger << " ";
+    }
+    cache.clear();
 
+    for (ArchiveSlot * slot : all) {
+        delete slot->archive;
+        delete slot;
     }
-    logger << Logger::endl;
+    lib.Deinitialize();
+}
 
+void Fuse7z::list(std::string const & source, bool directory) {
+    std::vector<std::string> files;
+    if (directory) {
+        DIR * dir = ::opendir(source.c_str());
+        if (dir == nullptr) {
+            throw std::runtime_error("Can't read " + source + ": " + strerror(errno));
+        }
+        while (struct dirent * entry = readdir(dir)) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            std::string filename = source + "/" + entry->d_name;
+            struct stat st;
+            if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                files.push_back(filename);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    }
+    else {
+        std::ifstream in(source.c_str());
+        if (!in) {
+            throw std::runtime_error("Can't read " + source + ": " + strerror(errno));
+        }
+        // relative paths are relative to the list
+        std::string base = source.substr(0, source.rfind('/') + 1);
+        std::string line;
+        while (std::getline(in, line)) {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            files.push_back(line[0] == '/' ? line : base + line);
+        }
+    }
 
-    if (lib.OpenArchive(&stream, &archive)) {
-        unsigned int numItems = 0;
+    // the directories are named after the archives, the same name twice
+    // gets a number
+    std::set<std::string> names;
+    for (std::string const & filename : files) {
+        std::string name = filename.substr(filename.rfind('/') + 1);
+        std::string unique = name;
+        for (int i = 2; unique.empty() || names.count(unique) != 0; ++i) {
+            unique = name + "~" + std::to_string(i);
+        }
+        if (add(filename, unique)) {
+            names.insert(unique);
+        }
+    }
+}
 
-        archive->GetItemCount(&numItems);
+bool Fuse7z::add(std::string const & filename, std::string const & name) {
+    ArchiveSlot * slot = new ArchiveSlot;
+    slot->filename = filename;
+    slot->serial = multi ? (unsigned int) slots.size() + 1 : 0;
+    slot->mount = nullptr;
+    slot->parent = nullptr;
+    slot->entry = Node::NEW_NODE_INDEX;
+    slot->extracted = false;
+    slot->archive = nullptr;
+    slot->refs = 0;
+    slot->used = 0;
+    slot->memory = 0;
 
-        logger << "Archive contains " << numItems << " entries" << Logger::endl;
-        Node * node = 0;
-        for(unsigned int i = 0;i < numItems;i++) {
-            C7ZipArchiveItem * pArchiveItem = nullptr;
-            if (archive->GetItemInfo(i, &pArchiveItem)) {
-                std::wstring wpath(pArchiveItem->GetFullPath());
-                std::string path;
-                path.resize(wpath.length());
-                std::copy(wpath.begin(), wpath.end(), path.begin());
-                logger << "path is " << path <<Logger::endl;
+    if (multi) {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) {
+            LOG(WARNING) << "Skipping " << filename << ": " << strerror(errno) << Logger::endl;
+            delete slot;
+            return false;
+        }
+        Node * mount = mounts.insert(name.c_str());
+        mount->is_dir = true;
+        mount->atime.tv_sec = st.st_atime;
+        mount->mtime.tv_sec = st.st_mtime;
+        mount->ctime.tv_sec = st.st_ctime;
+        slot->mount = mount;
+    }
+    slots.push_back(slot);
+    return true;
+}
 
-                node = root_node->insert(const_cast<char*>(path.c_str()));
-                node->id = i;
+bool Fuse7z::nested(Node const * node) {
+    if (!options.nested) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(node_mutex);
+        if (node->is_dir || node->id < 0) {
+            return false;
+        }
+    }
+    static char const * const extensions[] = {
+        "7z", "zip", "tar", "gz", "tgz", "bz2", "tbz2", "xz", "txz", "rar"
+    };
+    char const * dot = strrchr(node->name, '.');
+    if (dot == nullptr) {
+        return false;
+    }
+    for (char const * extension : extensions) {
+        if (strcasecmp(dot + 1, extension) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-                node->is_dir = pArchiveItem->IsDir();
-                logger << "node->is_dir " << node->is_dir <<Logger::endl;
-                
-                {
-                    unsigned long long size;
-                    pArchiveItem->GetUInt64Property(lib7zip::kpidSize, size);
-                    node->stat.st_size = size;
-                    logger << "node->stat.st_size " << node->stat.st_size <<Logger::endl;
-                }
+ArchiveSlot * Fuse7z::inner(ArchiveSlot * parent, Node * node) {
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    ArchiveSlot *& slot = inner_slots[std::make_pair(parent->serial, node->id)];
+    if (slot == nullptr) {
+        slot = new ArchiveSlot;
+        slot->filename = parent->filename + "/" + node->fullname();
+        slot->serial = (unsigned int) (slots.size() + inner_slots.size());
+        slot->mount = nullptr;
+        slot->parent = parent;
+        slot->entry = node->id;
+        slot->extracted = false;
+        slot->archive = nullptr;
+        slot->refs = 0;
+        slot->used = 0;
+        slot->memory = 0;
+    }
+    return slot;
+}
+
+Fuse7zArchive * Fuse7z::load(ArchiveSlot * slot) {
+    ArchiveSlot * parent = slot->parent;
+    if (parent == nullptr) {
+        return new Fuse7zArchive(lib, slot->filename, slot->serial, options, cache, stats, node_mutex);
+    }
+
+    // the outer archive stays open as long as the nested one, which reads
+    // its entry out of the cache
+    if (!pin(parent)) {
+        throw std::runtime_error("Can't open " + parent->filename);
+    }
+    Fuse7zArchive * outer = parent->archive;
+    Node * node = outer->item(slot->entry);
+    Fuse7zOutStream * stream = nullptr;
+    try {
+        stream = outer->open(node);
+        unsigned long long size;
+        {
+            std::lock_guard<std::mutex> lock(node_mutex);
+            size = node->size;
+        }
+        char const * dot = strrchr(node->name, '.');
+        std::wstring ext(dot + 1, dot + strlen(dot));
+        Fuse7zEntryInStream::read_t read = [outer, node] (char * buf, size_t size, off_t offset) {
+            return outer->read_direct(node, buf, size, offset);
+        };
+        Fuse7zArchive * archive = new Fuse7zArchive(lib, slot->filename, slot->serial, options, cache, stats, node_mutex,
+                [stream, read, size, ext] () -> C7ZipInStream * {
+                    return new Fuse7zEntryInStream(stream, read, size, ext);
+                });
+        slot->extracted = stream != nullptr;
+        return archive;
+    }
+    catch (...) {
+        if (stream != nullptr) {
+            outer->close(node);
+        }
+        unpin(parent);
+        throw;
+    }
+}
+
+void Fuse7z::unload(ArchiveSlot * slot, Fuse7zArchive * archive) {
+    delete archive;
+    ArchiveSlot * parent = slot->parent;
+    if (parent != nullptr) {
+        if (slot->extracted) {
+            parent->archive->close(parent->archive->item(slot->entry));
+        }
+        unpin(parent);
+    }
+}
+
+bool Fuse7z::pin(ArchiveSlot * slot) {
+    if (slot->serial == 0) {
+        // the archive of a single archive mount is open for the whole mount
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(slots_mutex);
+    if (slot->archive == nullptr) {
+        lock.unlock();
+        std::lock_guard<std::mutex> opening(slot->mutex);
+        lock.lock();
+        if (slot->archive == nullptr) {
+            lock.unlock();
+            Fuse7zArchive * archive;
+            try {
+                archive = load(slot);
+            }
+            catch (std::exception & e) {
+                LOG(ERROR) << e.what() << Logger::endl;
+                return false;
+            }
+            lock.lock();
+            slot->archive = archive;
+            slot->memory = archive->memory();
+            if (slot->extracted) {
+                // the decoded entry is held as long as the archive
+                slot->memory += slot->parent->archive->item(slot->entry)->size;
+            }
+            open_memory += slot->memory;
+        }
+    }
+    ++slot->refs;
+    slot->used = ++use_count;
+    trim(lock, slot);
+    return true;
+}
+
+void Fuse7z::unpin(ArchiveSlot * slot) {
+    if (slot->serial == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(slots_mutex);
+    --slot->refs;
+    trim(lock, nullptr);
+}
+
+void Fuse7z::trim(std::unique_lock<std::mutex> & lock, ArchiveSlot * keep) {
+    std::vector<std::pair<ArchiveSlot *, Fuse7zArchive *> > victims;
+    ArchiveSlot * victim;
+    auto consider = [&] (ArchiveSlot * slot) {
+        if (slot != keep && slot->serial != 0 && slot->archive != nullptr && slot->refs == 0 &&
+                (victim == nullptr || slot->used < victim->used)) {
+            victim = slot;
+        }
+    };
+    while (open_memory > options.index_memory) {
+        victim = nullptr;
+        for (ArchiveSlot * slot : slots) {
+            consider(slot);
+        }
+        for (auto & i : inner_slots) {
+            consider(i.second);
+        }
+        // pin() only holds the mutex of a closed archive
+        if (victim == nullptr || !victim->mutex.try_lock()) {
+            break;
+        }
+        // a pin() in the meantime waits on the mutex to open it again
+        victims.push_back(std::make_pair(victim, victim->archive));
+        open_memory -= victim->memory;
+        victim->archive = nullptr;
+    }
+    if (victims.empty()) {
+        return;
+    }
+
+    lock.unlock();
+    for (auto & i : victims) {
+        // its complete entries stay in the cache for the next open; an
+        // outer archive may be closed in turn
+        unload(i.first, i.second);
+        i.first->mutex.unlock();
+    }
+    lock.lock();
+}
 
-                {
-                    unsigned long long secpy, time, bias, gain;
-                    secpy = 31536000;
-                    gain = 10000000ULL;
-                    bias = secpy * gain * 369 + secpy * 2438356ULL + 5184000ULL;
-                    pArchiveItem->GetFileTimeProperty(lib7zip::kpidATime, time);
-                    node->stat.st_atime = (time - bias)/gain;
-                    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
-                    node->stat.st_atim.tv_nsec = ((time - bias) % gain) * 100;
-                    #endif
-                    pArchiveItem->GetFileTimeProperty(lib7zip::kpidCTime, time);
-                    node->stat.st_ctime = (time - bias)/gain;
-                    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
-                    node->stat.st_ctim.tv_nsec = ((time - bias) % gain) * 100;
-                    #endif
-                    pArchiveItem->GetFileTimeProperty(lib7zip::kpidMTime, time);
-                    node->stat.st_mtime = (time - bias)/gain;
-                    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
-                    node->stat.st_mtim.tv_nsec = ((time - bias) % gain) * 100;
-                    #endif
+Node * Fuse7z::descend(ArchiveSlot *& slot, char const * path, bool load) {
+    std::string prefix;
+    for (;;) {
+        Fuse7zArchive * archive = slot->archive;
+        Node * node = *path == '\0' ? archive->root() : archive->find(path);
+        char const * rest = "";
+        if (node == nullptr) {
+            if (!options.nested) {
+                return nullptr;
+            }
+            // the path goes through a nested archive: find the longest
+            // leading part of it which is a node
+            prefix.assign(path);
+            for (size_t end = prefix.rfind('/'); end != std::string::npos && end > 0; end = prefix.rfind('/')) {
+                prefix.resize(end);
+                node = archive->find(prefix.c_str());
+                if (node != nullptr) {
+                    rest = path + end + 1;
+                    break;
                 }
             }
+            if (node == nullptr || !nested(node)) {
+                return nullptr;
+            }
+        }
+        else if (!load || !nested(node)) {
+            return node;
+        }
 
-            if (node && ((i+1) % 10000 == 0)) {
-                logger << "Indexed " << (i+1) << "th file : " << node->fullname() << Logger::endl;
+        ArchiveSlot * next = inner(slot, node);
+        if (!pin(next)) {
+            return nullptr;
+        }
+        unpin(slot);
+        slot = next;
+        path = rest;
+    }
+}
+
+Node * Fuse7z::resolve(char const * path, bool load, ArchiveSlot *& slot) {
+    slot = nullptr;
+    ArchiveSlot * archive_slot;
+    if (!multi) {
+        archive_slot = slots[0];
+        if (!archive_slot->archive->ready()) {
+            // the statistics answer while the archive is indexed, instead
+            // of an entry of the same name it may have
+            Node * node = control(path);
+            if (node != nullptr) {
+                return node;
             }
         }
     }
     else {
-        std::stringstream ss;
-        ss << "open archive " << archive_fn  << " failed" << std::endl;
-        throw std::runtime_error(ss.str());
+        if (*path == '\0') {
+            return root_node;
+        }
+        Node * node = control(path);
+        if (node != nullptr) {
+            return node;
+        }
+        char const * rest = strchr(path, '/');
+        Node * mount = root_node->child(path, rest != nullptr ? rest - path : strlen(path));
+        if (mount == nullptr) {
+            return nullptr;
+        }
+        if (rest == nullptr && !load) {
+            return mount;
+        }
+        archive_slot = mount_slots[mount->ino];
+        if (!pin(archive_slot)) {
+            return nullptr;
+        }
+        path = rest != nullptr ? rest + 1 : "";
+    }
+
+    Node * node = descend(archive_slot, path, load);
+    if (node == nullptr) {
+        unpin(archive_slot);
+        return multi ? nullptr : control(path);
     }
+    slot = archive_slot;
+    return node;
 }
 
-Fuse7z::~Fuse7z() {
-    delete archive;
-    lib.Deinitialize();
+Node * Fuse7z::control(char const * path) {
+    size_t length = strlen(path);
+    if (control_dir.has_path(path, length)) {
+        return &control_dir;
+    }
+    if (control_file.has_path(path, length)) {
+        return &control_file;
+    }
+    return nullptr;
+}
+
+std::string Fuse7z::statistics() {
+    size_t entries;
+    unsigned long long unused;
+    cache.usage(entries, unused);
+    size_t packed;
+    unsigned long long packed_decoded;
+    unsigned long long packed_memory;
+    cache.packed_usage(packed, packed_decoded, packed_memory);
 
-    delete root_node;
+    size_t total;
+    size_t open = 0;
+    size_t nodes = 0;
+    size_t building = 0;
+    unsigned long long items = 0;
+    unsigned long long items_total = 0;
+    size_t memory;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        auto count = [&] (ArchiveSlot * slot) {
+            if (slot->archive != nullptr) {
+                ++open;
+                nodes += slot->archive->nodes();
+                hits += slot->archive->prefetch_hits();
+                misses += slot->archive->prefetch_misses();
+                if (!slot->archive->ready()) {
+                    unsigned int done, all;
+                    slot->archive->progress(done, all);
+                    ++building;
+                    items += done;
+                    items_total += all;
+                }
+            }
+        };
+        for (ArchiveSlot * slot : slots) {
+            count(slot);
+        }
+        for (auto & i : inner_slots) {
+            count(i.second);
+        }
+        total = slots.size() + inner_slots.size();
+        memory = open_memory;
+    }
+
+    std::ostringstream out;
+    out << "{\"archive\":" << json_string(archive_fn)
+        << ",\"archives\":{\"total\":" << total << ",\"open\":" << open << "}"
+        << ",\"index\":{\"nodes\":" << nodes << ",\"bytes\":" << memory
+        << ",\"indexing\":{\"archives\":" << building << ",\"items\":" << items << ",\"total\":" << items_total << "}}"
+        << ",\"cache\":{\"entries\":" << entries << ",\"unused_bytes\":" << unused
+        << ",\"capacity_bytes\":" << cache.capacity()
+        << ",\"compressed\":{\"entries\":" << packed << ",\"decoded_bytes\":" << packed_decoded
+        << ",\"bytes\":" << packed_memory << ",\"capacity_bytes\":" << cache.packed_capacity() << "}}"
+        << ",\"prefetch\":{\"hits\":" << hits << ",\"misses\":" << misses << "},";
+    stats.render(out);
+    out << "}\n";
+    return out.str();
 }
 
-void Fuse7z::open(char const * path, Node * node) {
-    Logger &logger = Logger::instance ();
-    logger << "Opening file " << path << "(" << node->fullname() << ")" << Logger::endl;
-    Fuse7zOutStream * stream = new Fuse7zOutStream;
-    node->buffer = stream;
-    stream->SetSize(node->stat.st_size);
-    int id = node->id;
-    archive->Extract(id, stream);
+FileHandle * Fuse7z::open(char const * path, Pin const & pin) {
+    Node * node = pin.node;
+    LOG(DEBUG) << "Opening file " << path << "(" << node->fullname() << ")" << Logger::endl;
+    Fuse7zStats::Timer timer(stats.open);
+    FileHandle * handle = new FileHandle;
+    handle->node = node;
+    handle->slot = nullptr;
+    handle->stream = nullptr;
+    if (is_control(node)) {
+        handle->text = statistics();
+        return handle;
+    }
+    try {
+        handle->stream = pin.slot->archive->open(node);
+    }
+    catch (...) {
+        delete handle;
+        throw;
+    }
+    // the archive is open already, this only counts the handle
+    this->pin(pin.slot);
+    handle->slot = pin.slot;
+    return handle;
 }
 
-void Fuse7z::close(char const * path, Node * node) {
-    Logger &logger = Logger::instance ();
-    logger << "Closing file " << path << "(" << node->fullname() << ")" << Logger::endl;
-    Fuse7zOutStream * stream = dynamic_cast<Fuse7zOutStream*>(node->buffer);
-    delete stream;
-    node->buffer = nullptr;
+FileHandle * Fuse7z::opendir(Pin const & pin) {
+    FileHandle * handle = new FileHandle;
+    handle->node = pin.node;
+    handle->slot = nullptr;
+    handle->stream = nullptr;
+    if (pin.slot != nullptr) {
+        // the listing needs every child of the directory
+        pin.slot->archive->wait();
+        this->pin(pin.slot);
+        handle->slot = pin.slot;
+    }
+    return handle;
+}
+
+void Fuse7z::close(char const * path, FileHandle * handle) {
+    LOG(DEBUG) << "Closing " << path << "(" << handle->node->fullname() << ")" << Logger::endl;
+    if (handle->stream != nullptr) {
+        handle->slot->archive->close(handle->node);
+    }
+    if (handle->slot != nullptr) {
+        unpin(handle->slot);
+    }
+    delete handle;
+}
+
+int Fuse7z::read(char const * path, FileHandle * handle, char * buf, size_t size, off_t offset) {
+    LOG(DEBUG) << "Reading file " << path << "(" << handle->node->fullname() << ") for " << size << " at " << offset << ", arch_id=" << handle->node->id << Logger::endl;
+    Fuse7zStats::Timer timer(stats.read);
+    int res;
+    if (is_control(handle->node)) {
+        std::string const & text = handle->text;
+        res = (unsigned long long)offset < text.size() ? (int) std::min(size, text.size() - offset) : 0;
+        memcpy(buf, text.data() + offset, res);
+        return res;
+    }
+    if (handle->stream == nullptr) {
+        res = handle->slot->archive->read_direct(handle->node, buf, size, offset);
+    }
+    else {
+        res = handle->stream->read(buf, size, offset);
+    }
+    if (res > 0) {
+        stats.bytes_served += res;
+    }
+    return res;
+}
+
+int Fuse7z::read_buf(char const * path, FileHandle * handle, struct fuse_bufvec ** bufp, size_t size, off_t offset) {
+    LOG(DEBUG) << "Reading file " << path << "(" << handle->node->fullname() << ") for " << size << " at " << offset << ", arch_id=" << handle->node->id << Logger::endl;
+    Fuse7zStats::Timer timer(stats.read);
+    if (is_control(handle->node)) {
+        std::string const & text = handle->text;
+        size = (unsigned long long)offset < text.size() ? std::min(size, text.size() - offset) : 0;
+        struct fuse_bufvec * bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+        if (bufv == nullptr) {
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].mem = (void *) (text.data() + (size ? offset : 0));
+        *bufp = bufv;
+        return 0;
+    }
+    if (handle->stream == nullptr && handle->node->data_offset != 0) {
+        // the kernel splices the pages of the archive itself
+        Node * node = handle->node;
+        if ((unsigned long long)offset >= node->size) {
+            size = 0;
+        }
+        else if (size > node->size - offset) {
+            size = node->size - offset;
+        }
+        struct fuse_bufvec * bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+        if (bufv == nullptr) {
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+        bufv->buf[0].fd = handle->slot->archive->descriptor();
+        bufv->buf[0].pos = node->data_offset + offset;
+        *bufp = bufv;
+        stats.bytes_served += size;
+        return 0;
+    }
+    if (handle->stream == nullptr) {
+        // decoded behind the vector
+        struct fuse_bufvec * bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) + size);
+        if (bufv == nullptr) {
+            return -ENOMEM;
+        }
+        int res = handle->slot->archive->read_direct(handle->node, (char *) (bufv + 1), size, offset);
+        if (res < 0) {
+            free(bufv);
+            return res;
+        }
+        *bufv = FUSE_BUFVEC_INIT((size_t) res);
+        bufv->buf[0].mem = bufv + 1;
+        *bufp = bufv;
+        stats.bytes_served += res;
+        return 0;
+    }
+
+    int err = handle->stream->wait(size, offset);
+    if (err != 0) {
+        return err;
+    }
+
+    BackingStore const * store = handle->stream->backing();
+    int fd = store->descriptor();
+    // one buffer per run of contiguous memory, the pages are handed out in place
+    size_t count = 0;
+    size_t contiguous;
+    for (size_t done = 0; done < size; ++count) {
+        if (store->data(offset + done, contiguous) == nullptr) {
+            break;
+        }
+        done += std::min(contiguous, size - done);
+    }
+    bool in_memory = size == 0 || count > 0;
+    // a store without either gets the bytes copied behind the vector
+    size_t extra = (!in_memory && fd < 0) ? size : 0;
+    size_t buffers = count > 1 ? count - 1 : 0;
+    struct fuse_bufvec * bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) + buffers * sizeof(struct fuse_buf) + extra);
+    if (bufv == nullptr) {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+
+    if (in_memory) {
+        bufv->count = std::max(count, (size_t) 1);
+        for (size_t i = 0, done = 0; i < count; ++i) {
+            char const * data = store->data(offset + done, contiguous);
+            bufv->buf[i] = bufv->buf[0];
+            bufv->buf[i].size = std::min(contiguous, size - done);
+            bufv->buf[i].mem = (void *) data;
+            done += bufv->buf[i].size;
+        }
+    }
+    else if (fd >= 0) {
+        bufv->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+        bufv->buf[0].fd = fd;
+        bufv->buf[0].pos = offset;
+    }
+    else {
+        bufv->buf[0].mem = bufv + 1;
+        if (size > 0 && !store->read(bufv->buf[0].mem, size, offset)) {
+            free(bufv);
+            return -EIO;
+        }
+    }
+    *bufp = bufv;
+    stats.bytes_served += size;
+    return 0;
+}
+
+void Fuse7z::getattr(Node * node, struct stat * stbuf, ArchiveSlot const * slot) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    bool dir;
+    {
+        std::lock_guard<std::mutex> lock(node_mutex);
+        node->fill_stat(stbuf);
+        dir = node->is_dir;
+    }
+    if (slot != nullptr) {
+        // the trees of the archives all number their nodes from 1
+        stbuf->st_ino |= (ino_t) slot->serial << 32;
+    }
+
+    // a nested archive is browsed as a directory
+    if (dir || nested(node)) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        // the directories have no children until the index is complete
+        unsigned int count = multi || node == &control_dir || slots[0]->archive->ready() ? node->child_count : 0;
+        stbuf->st_nlink = 2 + count;
+        stbuf->st_size = count;
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+    }
+
+    stbuf->st_blksize = STANDARD_BLOCK_SIZE;
+    stbuf->st_blocks = (stbuf->st_size + STANDARD_BLOCK_SIZE - 1) / STANDARD_BLOCK_SIZE;
+    LOG(DEBUG) << "stbuf->st_size " << stbuf->st_size << " = " << " stbuf->st_blocks " << stbuf->st_blocks << " * " << "stbuf->st_blksize " << stbuf->st_blksize << Logger::endl;
+
+    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    stbuf->st_uid = geteuid();
+    stbuf->st_gid = getegid();
+    #else
+    //TODO: should we really do it?
+    stbuf->st_uid = 0;
+    stbuf->st_gid = 0;
+    #endif
+}
+
+int Fuse7z::statfs(struct statvfs * buf) {
+    int err;
+    auto cwdStrPtr=cwd.c_str();
+
+    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    struct statvfs st;
+    if ((err = statvfs(cwdStrPtr, &st)) != 0) {
+        return -err;
+    }
+    buf->f_bavail = buf->f_bfree = st.f_frsize * st.f_bavail;
+    #else
+    ULARGE_INTEGER f_avail, f_free;
+    GetDiskFreeSpaceExA(cwdStrPtr, nullptr, &f_avail, &f_free);
+    buf->f_bavail = buf->f_bfree = f_avail.QuadPart;
+    #endif
+    LOG(DEBUG) << "buf->f_bavail " << buf->f_bavail << " buf->f_bfree " << buf->f_bfree << Logger::endl;
+
+    buf->f_bsize = 1;
+    buf->f_blocks = buf->f_bavail + 0;
+
+    buf->f_ffree = 0;
+    buf->f_favail = 0;
+
+    buf->f_files = -1; // TODO tree.size() - 1;
+    buf->f_namemax = 255;
+
+    return 0;
 }
 
-int Fuse7z::read(char const * path, Node * node, char * buf, size_t size, off_t offset) {
-    Logger &logger = Logger::instance ();
-    logger << "Reading file " << path << "(" << node->fullname() << ") for " << size << " at " << offset << ", arch_id=" << node->id << Logger::endl;
-    Fuse7zOutStream * stream = dynamic_cast<Fuse7zOutStream*>(node->buffer);
-    memcpy(buf, &stream->buffer[offset], size);
-    return size;
+void Fuse7z::utimens(Node * node, struct timespec const & mtime) {
+    std::lock_guard<std::mutex> lock(node_mutex);
+    node->mtime = mtime;
 }
@@ -17,31 +17,354 @@
 #include "node.h"
 #include "logger.h"
 #include "fuse7zstream.h"
+#include "fuse7zcache.h"
+#include "fuse7zarchive.h"
+#include "fuse7zstats.h"
+#include "options.h"
 
 #include <string>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <vector>
 #include <lib7zip.h>
+#include <fuse_common.h>
+
+/**
+ * An archive of the mount, opened on its first use. The archives of a
+ * multi-archive mount and the nested ones are closed again when nobody uses
+ * them, to keep their indexes within the index_memory budget.
+ */
+struct ArchiveSlot
+{
+	// absolute path of the archive
+	std::string filename;
+	// 0 for the archive of a single archive mount, its cache keys and the
+	// high bits of its inode numbers
+	unsigned int serial;
+	// its directory in a multi-archive mount, nullptr for a single archive
+	Node * mount;
+	// the archive holding a nested archive and the item id of its entry,
+	// nullptr for the archives of the source
+	ArchiveSlot * parent;
+	int entry;
+	// the entry is extracted, not stored, and held while the archive is open
+	bool extracted;
+	// held while the archive is opened or closed
+	std::mutex mutex;
+	// nullptr while closed; the fields below are guarded by slots_mutex
+	Fuse7zArchive * archive;
+	// lookups and handles using the archive, it stays open while > 0
+	unsigned int refs;
+	// use counter at its last use, the least recently used is closed first
+	unsigned long long used;
+	// index bytes accounted in the budget
+	size_t memory;
+};
+
+/**
+ * State of an open file or directory, kept in fuse_file_info::fh
+ */
+struct FileHandle
+{
+	Node * node;
+	// archive of the node, kept open by the handle; nullptr for the mount
+	// directories and the control files
+	ArchiveSlot * slot;
+	// nullptr if the entry is read straight from the archive
+	Fuse7zOutStream * stream;
+	// content of a control file, taken at open
+	std::string text;
+};
 
 class Fuse7z
 {
 	C7ZipLibrary lib;
-	C7ZipArchive * archive;
-	Fuse7zInStream stream;
+	Fuse7zOptions const options;
+	Fuse7zCache cache;
+	// one archive, or the archives of the source directory or list file
+	std::vector<ArchiveSlot *> slots;
+	bool multi;
+	// the directories of a multi-archive mount, one per archive
+	NodeTree mounts;
+	// the slots by inode of their directory in mounts
+	std::vector<ArchiveSlot *> mount_slots;
+	// nested archives by serial of the outer archive and item id of the entry
+	std::map<std::pair<unsigned int, int>, ArchiveSlot *> inner_slots;
+	std::mutex slots_mutex;
+	// index bytes of the open archives
+	size_t open_memory;
+	unsigned long long use_count;
+	// guards the times of the nodes, utimens() changes them, the size of a
+	// gzip file, known once it is decoded to the end, and the nodes of an
+	// archive indexed in the background, looked up before their last item
+	std::mutex node_mutex;
+	// the hidden /.fuse7z directory and its stats file, outside of the tree
+	Node control_dir;
+	Node control_file;
+	Node * control_childs[1];
+
+	/**
+	 * Fill the slots of a multi-archive mount with the files of a
+	 * directory, or the paths listed one per line in a file.
+	 */
+	void list(std::string const & source, bool directory);
+
+	/**
+	 * Add an archive, with a directory of its own in a multi-archive mount.
+	 * @param name of the directory
+	 * @return false if the archive of a multi-archive mount is missing
+	 */
+	bool add(std::string const & filename, std::string const & name);
+
+	/**
+	 * @return true for the entries browsed as nested archives
+	 */
+	bool nested(Node const * node);
+
+	/**
+	 * The slot of the archive in an entry of another archive.
+	 */
+	ArchiveSlot * inner(ArchiveSlot * parent, Node * node);
+
+	/**
+	 * Open the archive of a slot, throws std::runtime_error if it can't.
+	 */
+	Fuse7zArchive * load(ArchiveSlot * slot);
+
+	/**
+	 * Close the archive taken out of a slot, and let go of the outer one.
+	 */
+	void unload(ArchiveSlot * slot, Fuse7zArchive * archive);
+
+	/**
+	 * Take a reference on an archive, opening it if it is closed.
+	 * @return false if the archive can't be opened
+	 */
+	bool pin(ArchiveSlot * slot);
+
+	/**
+	 * Drop a reference taken by pin().
+	 */
+	void unpin(ArchiveSlot * slot);
+
+	/**
+	 * Close the least recently used archives nobody uses until the open
+	 * indexes fit in the budget. Called with slots_mutex held.
+	 */
+	void trim(std::unique_lock<std::mutex> & lock, ArchiveSlot * keep);
+
+	/**
+	 * Look a path up in a pinned archive, entering the nested archives it
+	 * goes through.
+	 * @param slot moved to the pinned archive of the node
+	 * @param load enter a nested archive the path ends at
+	 * @return the node, nullptr if none
+	 */
+	Node * descend(ArchiveSlot *& slot, char const * path, bool load);
+
+	/**
+	 * @param slot set to the archive of the node, pinned; nullptr if none
+	 * @return the node at path, nullptr if none
+	 */
+	Node * resolve(char const * path, bool load, ArchiveSlot *& slot);
+
+	/**
+	 * @return the control node at path, nullptr if none
+	 */
+	Node * control(char const * path);
+
+	/**
+	 * The statistics of the mount as a JSON document.
+	 */
+	std::string statistics();
 
 	public:
-	Fuse7z(std::string const & filename, std::string const & cwd);
+	/**
+	 * @param source an archive, a directory of archives or, with the
+	 *        archive_list option, a file listing archives
+	 */
+	Fuse7z(std::string const & source, std::string const & cwd, Fuse7zOptions const & options);
 
 	virtual ~Fuse7z();
 
-	virtual void open(char const * path, Node * node);
+	/**
+	 * Start the threads of the process which serves the mount, after the
+	 * daemonization: the indexing with background_index.
+	 */
+	void start();
 
-	virtual void close(char const * path, Node * node);
+	/**
+	 * A node looked up by path. Its archive stays open while the Pin lives.
+	 */
+	class Pin
+	{
+		public:
+		/**
+		 * @param path full path of the node, without the leading slash
+		 * @param load false to get the directory of an archive of a
+		 *        multi-archive mount, or the entry of a nested archive,
+		 *        without opening it, for its attributes
+		 */
+		Pin(Fuse7z & fs, char const * path, bool load = true) :
+			fs(fs), slot(nullptr)
+		{
+			node = fs.resolve(path, load, slot);
+		}
 
-	virtual int read(char const * path, Node * node, char * buf, size_t size, off_t offset);
+		/**
+		 * A node of a single archive mount, or a control node.
+		 */
+		Pin(Fuse7z & fs, Node * node) :
+			node(node), fs(fs), slot(nullptr)
+		{
+			if (!fs.multi && !fs.is_control(node) && node != &fs.control_dir) {
+				slot = fs.slots[0];
+			}
+		}
+
+		~Pin()
+		{
+			if (slot != nullptr) {
+				fs.unpin(slot);
+			}
+		}
+
+		Pin(Pin const &) = delete;
+		Pin & operator=(Pin const &) = delete;
+
+		// nullptr if there is no such node
+		Node * node;
+
+		private:
+		friend class Fuse7z;
+		Fuse7z & fs;
+		ArchiveSlot * slot;
+	};
+
+	/**
+	 * Look a name up in a directory of a single archive mount, the control
+	 * directory included.
+	 */
+	Node * child(Node * dir, char const * name, size_t length)
+	{
+		if (dir == &control_dir) {
+			return dir->child(name, length);
+		}
+		bool control = dir == root_node && control_dir.has_path(name, length);
+		// the statistics answer while the archive is indexed
+		if (control && !slots[0]->archive->ready()) {
+			return &control_dir;
+		}
+		Node * node = slots[0]->archive->child(dir, name, length);
+		return node == nullptr && control ? &control_dir : node;
+	}
+
+	/**
+	 * @return the node of a single archive mount with the given inode
+	 * number, nullptr if none
+	 */
+	Node * at(unsigned long ino)
+	{
+		if (ino == control_dir.ino) {
+			return &control_dir;
+		}
+		if (ino == control_file.ino) {
+			return &control_file;
+		}
+		return ino > UINT_MAX ? nullptr : slots[0]->archive->at((unsigned int) ino);
+	}
+
+	/**
+	 * Block until the children of a directory of a single archive mount
+	 * are known, the archive may still be indexed.
+	 */
+	void wait_children(Node const * dir)
+	{
+		if (dir != &control_dir) {
+			slots[0]->archive->wait();
+		}
+	}
+
+	/**
+	 * @return true if the mount serves more than one archive: a directory
+	 * or a list of them, or nested archives
+	 */
+	bool is_multi() const
+	{
+		return multi || options.nested;
+	}
+
+	/**
+	 * @return true for the files whose content is generated at open, they
+	 * have no size and must be read with direct_io
+	 */
+	bool is_control(Node const * node) const
+	{
+		return node == &control_file;
+	}
+
+	/**
+	 * @return true for the directories; a file looked up while its archive
+	 * is indexed turns into one if a later item is below it
+	 */
+	bool is_dir(Node const * node)
+	{
+		std::lock_guard<std::mutex> lock(node_mutex);
+		return node->is_dir;
+	}
+
+	virtual FileHandle * open(char const * path, Pin const & pin);
+
+	/**
+	 * Keep a directory and its archive for the pages of its listing.
+	 */
+	FileHandle * opendir(Pin const & pin);
+
+	/**
+	 * Release a handle of open() or opendir().
+	 */
+	virtual void close(char const * path, FileHandle * handle);
+
+	virtual int read(char const * path, FileHandle * handle, char * buf, size_t size, off_t offset);
+
+	/**
+	 * Describe [offset, offset+size) of the entry without copying it: the
+	 * buffer points into the decoded memory, or at the spill file so that
+	 * libfuse can splice it. Short at EOF.
+	 * @param bufp receives a malloc()ed vector, to be freed by the caller
+	 * @return 0 or -errno
+	 */
+	virtual int read_buf(char const * path, FileHandle * handle, struct fuse_bufvec ** bufp, size_t size, off_t offset);
+
+	/**
+	 * Fill the stat of the node, consistent with a concurrent utimens().
+	 * @param slot archive of the node, which numbers its inodes in a
+	 *        multi-archive mount
+	 */
+	void getattr(Node * node, struct stat * stbuf, ArchiveSlot const * slot = nullptr);
+
+	void getattr(Pin const & pin, struct stat * stbuf)
+	{
+		getattr(pin.node, stbuf, pin.slot);
+	}
+
+	/**
+	 * Report the free space of the working directory's file system.
+	 * @return 0 or -errno
+	 */
+	int statfs(struct statvfs * buf);
+
+	void utimens(Node * node, struct timespec const & mtime);
 
     // FIXME: these must be private
     public:
 	std::string const archive_fn;
 	std::string const cwd;
+	// set fuse_file_info::keep_cache on open
+	bool const keep_cache;
+	// attribute and entry timeout of the low-level replies
+	double const cache_timeout;
 	Node * root_node;
+	Fuse7zStats stats;
 };
-
@@ -0,0 +1,431 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zarchive.h"
+#include "fuse7zindex.h"
+#include "fuse7zstored.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// items indexed between two looks of the waiting lookups at the tree
+static const unsigned int INDEX_BATCH = 1024;
+
+Fuse7zArchive::Fuse7zArchive(C7ZipLibrary & lib, std::string const & filename, unsigned int serial,
+        Fuse7zOptions const & options, Fuse7zCache & cache, Fuse7zStats & stats, std::mutex & node_mutex,
+        ArchivePool::open_t const & open, bool background) :
+         filename (filename),
+         lib (lib),
+         options (options),
+         opener (open),
+         serial (serial),
+         cache (cache),
+         stats (stats),
+         node_mutex (node_mutex),
+         pool (nullptr),
+         archive_fd (-1),
+         archive_size (0),
+         root_node (tree.root()),
+         background (background),
+         complete (false),
+         cancelled (false),
+         indexed_items (0),
+         total_items (0),
+         gzip (nullptr),
+         prefetcher (options, cache, serial, items, [this] (int id, Fuse7zOutStream * out) { extract(id, out); })
+{
+    LOG(INFO) << "Opening archive " << filename << Logger::endl;
+
+    if (!open) {
+        archive_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (archive_fd < 0 || fstat(archive_fd, &st) != 0) {
+            std::string error = strerror(errno);
+            if (archive_fd >= 0) {
+                ::close(archive_fd);
+            }
+            throw std::runtime_error("Can't open " + filename + ": " + error);
+        }
+        archive_size = st.st_size;
+    }
+    if (background) {
+        return;
+    }
+
+    try {
+        build();
+    }
+    catch (...) {
+        delete gzip;
+        delete pool;
+        if (archive_fd >= 0) {
+            ::close(archive_fd);
+        }
+        throw;
+    }
+}
+
+void Fuse7zArchive::start() {
+    if (!background || indexer.joinable()) {
+        return;
+    }
+    indexer = std::thread(&Fuse7zArchive::build, this);
+}
+
+void Fuse7zArchive::build() {
+    try {
+        pool = new ArchivePool(lib, filename, options.archive_handles, opener, options.mmap_archive);
+        if (options.index_cache.empty() || archive_fd < 0) {
+            index(pool->first());
+        }
+        else {
+            IndexCache index_cache(options.index_cache, filename);
+            bool loaded;
+            {
+                std::lock_guard<std::mutex> lock(index_mutex);
+                loaded = index_cache.load(tree);
+            }
+            if (loaded) {
+                LOG(INFO) << "Index loaded from " << index_cache.filename() << Logger::endl;
+            }
+            else {
+                index(pool->first());
+                index_cache.save(tree);
+            }
+        }
+    }
+    catch (std::exception & e) {
+        if (!background) {
+            throw;
+        }
+        // the mount stays up with what was indexed, nothing more shows up
+        if (cancelled) {
+            LOG(INFO) << "Indexing of " << filename << " interrupted" << Logger::endl;
+        }
+        else {
+            LOG(ERROR) << "Indexing of " << filename << " stopped: " << e.what() << Logger::endl;
+        }
+        std::lock_guard<std::mutex> lock(index_mutex);
+        indexed_items = total_items.load();
+        tree.finalize();
+    }
+    LOG(INFO) << "Index of " << nodes() << " nodes uses " << memory() << " bytes" << Logger::endl;
+
+    for (size_t ino = 1; ino <= tree.size(); ++ino) {
+        Node * node = tree.at((unsigned int) ino);
+        if (node->id < 0) {
+            continue;
+        }
+        if ((size_t)node->id >= items.size()) {
+            items.resize(node->id + 1, nullptr);
+        }
+        items[node->id] = node;
+    }
+
+    // a gzip file is a single stream, reads anywhere in it would otherwise
+    // have to wait for it to be decoded up to there
+    if (archive_fd >= 0 && items.size() == 1 && items[0] != nullptr && !items[0]->is_dir && items[0]->data_offset == 0) {
+        gzip = GzipReader::create(archive_fd, filename, options);
+        unsigned long long size;
+        if (gzip != nullptr && gzip->size(size)) {
+            // the trailer only has the size modulo 4G
+            items[0]->size = size;
+        }
+        else if (gzip != nullptr) {
+            Node * node = items[0];
+            gzip->finish([this, node] (unsigned long long size) {
+                std::lock_guard<std::mutex> lock(node_mutex);
+                node->size = size;
+            });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        complete = true;
+    }
+    indexed.notify_all();
+}
+
+void Fuse7zArchive::wait() const {
+    if (ready()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(index_mutex);
+    indexed.wait(lock, [this] { return ready(); });
+}
+
+Node * Fuse7zArchive::early(std::function<Node * ()> const & lookup) const {
+    if (ready()) {
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock(index_mutex);
+    while (!ready()) {
+        // the links of the tree under construction are gone once the items
+        // are all in, the lookups wait for the finalized tree then
+        if (indexed_items < total_items) {
+            // a directory may still get children, only its listing waits
+            // for the complete index
+            Node * node = lookup();
+            if (node != nullptr) {
+                return node;
+            }
+        }
+        indexed.wait(lock);
+    }
+    return nullptr;
+}
+
+Node * Fuse7zArchive::find(char const * path) const {
+    Node * node = early([&] { return tree.lookup(path); });
+    return node != nullptr ? node : tree.find(path);
+}
+
+Node * Fuse7zArchive::child(Node * dir, char const * name, size_t length) const {
+    Node * node = early([&] { return tree.lookup(dir, name, length); });
+    return node != nullptr ? node : dir->child(name, length);
+}
+
+Node * Fuse7zArchive::at(unsigned int ino) const {
+    if (ready()) {
+        return tree.at(ino);
+    }
+    // the inodes handed out early are those of the nodes indexed so far
+    std::lock_guard<std::mutex> lock(index_mutex);
+    return tree.at(ino);
+}
+
+void Fuse7zArchive::index(C7ZipArchive * archive) {
+    unsigned int numItems = 0;
+
+    archive->GetItemCount(&numItems);
+
+    LOG(INFO) << "Archive contains " << numItems << " entries" << Logger::endl;
+
+    // the lookups see the tree between two batches of items
+    std::unique_lock<std::mutex> lock(index_mutex);
+    total_items = numItems;
+
+    // in a solid archive the packed size is only reported by the first
+    // entry of each block, the following ones are decoded through it
+    bool solid = false;
+    archive->GetBoolProperty(lib7zip::kpidSolid, solid);
+    int block = -1;
+    unsigned long long block_offset = 0;
+
+    Node * node = 0;
+    for(unsigned int i = 0;i < numItems;i++) {
+        C7ZipArchiveItem * pArchiveItem = nullptr;
+        if (archive->GetItemInfo(i, &pArchiveItem)) {
+            std::wstring wpath(pArchiveItem->GetFullPath());
+            std::string path;
+            path.resize(wpath.length());
+            std::copy(wpath.begin(), wpath.end(), path.begin());
+            LOG(DEBUG) << "path is " << path <<Logger::endl;
+
+            // a node of an earlier item may have been looked up already:
+            // its type and attributes change under node_mutex
+            node = tree.insert(path.c_str(), background ? &node_mutex : nullptr);
+            std::unique_lock<std::mutex> attributes(node_mutex, std::defer_lock);
+            if (background && (node->is_dir || node->id != Node::NEW_NODE_INDEX)) {
+                attributes.lock();
+            }
+            node->id = i;
+
+            bool is_dir = pArchiveItem->IsDir();
+            if (node->is_dir != is_dir) {
+                node->is_dir = is_dir;
+            }
+            LOG(DEBUG) << "node->is_dir " << node->is_dir <<Logger::endl;
+            
+            {
+                unsigned long long size;
+                pArchiveItem->GetUInt64Property(lib7zip::kpidSize, size);
+                node->size = size;
+                LOG(DEBUG) << "node->size " << node->size <<Logger::endl;
+
+                if (solid && !node->is_dir && size > 0) {
+                    unsigned long long packed = 0;
+                    pArchiveItem->GetUInt64Property(lib7zip::kpidPackSize, packed);
+                    if (packed > 0 || block < 0) {
+                        ++block;
+                        block_offset = 0;
+                    }
+                    node->block = block;
+                    node->block_offset = block_offset;
+                    block_offset += size;
+                }
+            }
+
+            {
+                unsigned long long secpy, time, bias, gain;
+                secpy = 31536000;
+                gain = 10000000ULL;
+                bias = secpy * gain * 369 + secpy * 2438356ULL + 5184000ULL;
+                pArchiveItem->GetFileTimeProperty(lib7zip::kpidATime, time);
+                node->atime.tv_sec = (time - bias)/gain;
+                #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+                node->atime.tv_nsec = ((time - bias) % gain) * 100;
+                #endif
+                pArchiveItem->GetFileTimeProperty(lib7zip::kpidCTime, time);
+                node->ctime.tv_sec = (time - bias)/gain;
+                #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+                node->ctime.tv_nsec = ((time - bias) % gain) * 100;
+                #endif
+                pArchiveItem->GetFileTimeProperty(lib7zip::kpidMTime, time);
+                node->mtime.tv_sec = (time - bias)/gain;
+                #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+                node->mtime.tv_nsec = ((time - bias) % gain) * 100;
+                #endif
+            }
+        }
+
+        if (node && ((i+1) % 10000 == 0)) {
+            LOG(INFO) << "Indexed " << (i+1) << "th file : " << node->fullname() << Logger::endl;
+        }
+        if ((i + 1) % INDEX_BATCH == 0 || i + 1 == numItems) {
+            indexed_items = i + 1;
+            lock.unlock();
+            indexed.notify_all();
+            if (cancelled) {
+                throw std::runtime_error("unmounted");
+            }
+            lock.lock();
+        }
+    }
+
+    if (solid) {
+        LOG(INFO) << "Solid archive with " << (block + 1) << " blocks" << Logger::endl;
+    }
+    tree.finalize();
+    lock.unlock();
+
+    if (archive_fd < 0) {
+        return;
+    }
+    size_t stored = StoredScanner(archive_fd, archive_size).scan(tree);
+    if (stored > 0) {
+        LOG(INFO) << stored << " entries are stored uncompressed, they are read from the archive directly" << Logger::endl;
+    }
+}
+
+Fuse7zArchive::~Fuse7zArchive() {
+    cancelled = true;
+    if (indexer.joinable()) {
+        indexer.join();
+    }
+    stop();
+    LOG(INFO) << "Closing archive " << filename << ", prefetch hits " << prefetcher.hits() << ", misses " << prefetcher.misses() << Logger::endl;
+
+    delete gzip;
+    delete pool;
+    if (archive_fd >= 0) {
+        ::close(archive_fd);
+    }
+}
+
+void Fuse7zArchive::stop() {
+    prefetcher.stop();
+}
+
+void Fuse7zArchive::extract(int id, Fuse7zOutStream * out) {
+    ++stats.extractions_running;
+    ++stats.extractions_started;
+    Fuse7zStats::clock::time_point start = Fuse7zStats::clock::now();
+    bool ok;
+    try {
+        ArchiveLease lease(*pool);
+        ok = lease.archive()->Extract(id, out);
+    }
+    catch (std::exception & e) {
+        LOG(ERROR) << e.what() << Logger::endl;
+        ok = false;
+    }
+    if (!ok) {
+        LOG(ERROR) << "Extraction of entry " << id << " of " << filename << " failed" << Logger::endl;
+    }
+
+    --stats.extractions_running;
+    Node * node = items[id];
+    stats.extracted(node ? node->fullname() : std::to_string(id), node ? node->size : 0,
+            std::chrono::duration_cast<std::chrono::microseconds>(Fuse7zStats::clock::now() - start).count(), ok);
+    // last: once the stream is complete nothing keeps the archive open, it
+    // may be closed while this thread winds down
+    out->finish(ok);
+}
+
+Fuse7zOutStream * Fuse7zArchive::open(Node * node) {
+    // where the entry is stored is only known once the index is complete
+    wait();
+    prefetcher.opened(node);
+    if (node->data_offset != 0) {
+        ++stats.stored_opens;
+        return nullptr;
+    }
+    if (gzip != nullptr) {
+        ++stats.checkpointed_opens;
+        return nullptr;
+    }
+    bool created;
+    Fuse7zOutStream * stream = cache.acquire(Fuse7zCache::key(serial, node->id), node->size, node->block_offset, created);
+    ++(created ? stats.cache_misses : stats.cache_hits);
+    if (created) {
+        // decode in the background, read() waits only for the range it needs
+        stream->worker = std::thread(&Fuse7zArchive::extract, this, node->id, stream);
+    }
+    return stream;
+}
+
+void Fuse7zArchive::close(Node * node) {
+    cache.release(Fuse7zCache::key(serial, node->id));
+}
+
+int Fuse7zArchive::read_direct(Node * node, char * buf, size_t size, off_t offset) {
+    if (node->data_offset == 0) {
+        return gzip->read(buf, size, offset);
+    }
+    if ((unsigned long long)offset >= node->size) {
+        return 0;
+    }
+    // the count goes back as an int, a nested archive reader gets a short read
+    size = std::min(size, (size_t) INT_MAX);
+    if (size > node->size - offset) {
+        size = node->size - offset;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(archive_fd, buf + done, size - done, node->data_offset + offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -errno;
+        }
+        if (n == 0) {
+            // the archive was truncated under the mount
+            return -EIO;
+        }
+        done += n;
+    }
+    return (int) done;
+}
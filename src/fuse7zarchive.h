@@ -0,0 +1,235 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "node.h"
+#include "fuse7zstream.h"
+#include "fuse7zcache.h"
+#include "fuse7zgzip.h"
+#include "fuse7zpool.h"
+#include "fuse7zprefetch.h"
+#include "fuse7zstats.h"
+#include "options.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <lib7zip.h>
+
+/**
+ * One archive of the mount: its node tree, its handles and the extraction
+ * of its entries into the cache the archives of a mount share.
+ */
+class Fuse7zArchive
+{
+	public:
+	/**
+	 * Open the archive and index it, or load its saved index.
+	 * @param serial number of the archive in the mount, part of its cache keys
+	 * @param node_mutex guards the attributes of the nodes, a gzip file gets
+	 *        its size once decoded to the end
+	 * @param open reads a nested archive out of the entry of another one,
+	 *        filename only names it then; its index is not saved
+	 * @param background only open the archive file, start() indexes it
+	 * @throw std::runtime_error if the archive can't be opened
+	 */
+	Fuse7zArchive(C7ZipLibrary & lib, std::string const & filename, unsigned int serial,
+			Fuse7zOptions const & options, Fuse7zCache & cache, Fuse7zStats & stats, std::mutex & node_mutex,
+			ArchivePool::open_t const & open = ArchivePool::open_t(), bool background = false);
+
+	/**
+	 * Nothing of the archive may be open anymore.
+	 */
+	~Fuse7zArchive();
+
+	/**
+	 * Index a background archive in a thread. Meanwhile the lookups answer
+	 * the nodes indexed so far and wait for the rest; an archive which
+	 * can't be indexed ends up empty.
+	 */
+	void start();
+
+	/**
+	 * @return true once the index is complete
+	 */
+	bool ready() const
+	{
+		return complete.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Block until the index is complete.
+	 */
+	void wait() const;
+
+	/**
+	 * Items indexed so far out of total, while the archive is indexed.
+	 */
+	void progress(unsigned int & done, unsigned int & total) const
+	{
+		done = indexed_items;
+		total = total_items;
+	}
+
+	Node * root()
+	{
+		return root_node;
+	}
+
+	/**
+	 * @param path full path of the node in the archive, without the leading slash
+	 */
+	Node * find(char const * path) const;
+
+	/**
+	 * Look a name up in a directory of the archive.
+	 */
+	Node * child(Node * dir, char const * name, size_t length) const;
+
+	/**
+	 * @return the node with the given inode number, nullptr if none
+	 */
+	Node * at(unsigned int ino) const;
+
+	/**
+	 * @return the node of an archive item id, nullptr if none
+	 */
+	Node * item(int id) const
+	{
+		wait();
+		return id >= 0 && (size_t)id < items.size() ? items[id] : nullptr;
+	}
+
+	size_t nodes() const
+	{
+		std::lock_guard<std::mutex> lock(index_mutex);
+		return tree.size();
+	}
+
+	/**
+	 * Bytes held by the index of the archive.
+	 */
+	size_t memory() const
+	{
+		std::lock_guard<std::mutex> lock(index_mutex);
+		return tree.memory();
+	}
+
+	/**
+	 * Take a reference on the decoded content of a file, extracting it in
+	 * the background if the cache doesn't have it.
+	 * @return nullptr if the entry is read with read_direct() instead
+	 */
+	Fuse7zOutStream * open(Node * node);
+
+	/**
+	 * Drop the reference taken by open() on a stream.
+	 */
+	void close(Node * node);
+
+	/**
+	 * Read an entry open() returned no stream for: pread() it if it is
+	 * stored uncompressed, else decode it from its gzip checkpoints.
+	 * @return the bytes read, short at EOF and at most INT_MAX, or -errno
+	 */
+	int read_direct(Node * node, char * buf, size_t size, off_t offset);
+
+	/**
+	 * The archive file, where the stored entries start at their data_offset
+	 * and can be spliced from; -1 for a nested archive, which has none.
+	 */
+	int descriptor() const
+	{
+		return archive_fd;
+	}
+
+	/**
+	 * Abort the prefetch, the cache must be cleared after this and before
+	 * the archive is deleted.
+	 */
+	void stop();
+
+	unsigned long long prefetch_hits()
+	{
+		return prefetcher.hits();
+	}
+
+	unsigned long long prefetch_misses()
+	{
+		return prefetcher.misses();
+	}
+
+	std::string const filename;
+
+	private:
+	/**
+	 * Decode an item into the stream and finish it.
+	 */
+	void extract(int id, Fuse7zOutStream * out);
+
+	/**
+	 * Open the handles, load or build the node tree and complete the index.
+	 * @throw std::runtime_error if the archive can't be opened, unless
+	 *        in the background
+	 */
+	void build();
+
+	/**
+	 * Build the node tree from the items of the archive.
+	 */
+	void index(C7ZipArchive * archive);
+
+	/**
+	 * Wait until lookup() finds a node or the index is complete.
+	 * @return the node, nullptr once the index is complete
+	 */
+	Node * early(std::function<Node * ()> const & lookup) const;
+
+	C7ZipLibrary & lib;
+	Fuse7zOptions const & options;
+	ArchivePool::open_t const opener;
+	unsigned int const serial;
+	Fuse7zCache & cache;
+	Fuse7zStats & stats;
+	std::mutex & node_mutex;
+	ArchivePool * pool;
+	// the archive file, for the entries stored uncompressed, -1 if nested
+	int archive_fd;
+	unsigned long long archive_size;
+	NodeTree tree;
+	Node * const root_node;
+	bool const background;
+	// indexes the archive with background, started by start()
+	std::thread indexer;
+	// guards the tree while it is built, lookups wait on indexed for the
+	// next batch of items or the complete index
+	mutable std::mutex index_mutex;
+	mutable std::condition_variable indexed;
+	std::atomic<bool> complete;
+	std::atomic<bool> cancelled;
+	std::atomic<unsigned int> indexed_items;
+	std::atomic<unsigned int> total_items;
+	// the nodes by archive item id
+	std::vector<Node *> items;
+	// random access into the entry of a gzip file, nullptr if none
+	GzipReader * gzip;
+	Fuse7zPrefetcher prefetcher;
+};
@@ -0,0 +1,383 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "fuse7zbacking.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+BackingStore *
+BackingStore::create(unsigned long long size, unsigned long long threshold, std::string const & spill_dir,
+		bool huge_pages)
+{
+	BackingStore * store;
+	if (size > threshold) {
+		store = new FileBackingStore(spill_dir);
+	} else {
+		store = new MemoryBackingStore(huge_pages);
+	}
+	try {
+		store->resize(size);
+	}
+	catch (...) {
+		delete store;
+		throw;
+	}
+	return store;
+}
+
+// what the pages which were never written read as; not const, so it is
+// in .bss rather than 2M of the binary, nothing writes it
+static char zero_page[MemoryBackingStore::PAGE_LENGTH];
+
+MemoryBackingStore::MemoryBackingStore(bool huge_pages) :
+	huge_pages(huge_pages),
+	length(0)
+{
+}
+
+MemoryBackingStore::~MemoryBackingStore()
+{
+	release();
+}
+
+size_t
+MemoryBackingStore::page_length(size_t index) const
+{
+	return std::min((unsigned long long)PAGE_LENGTH, length - ((unsigned long long)index << PAGE_SHIFT));
+}
+
+bool
+MemoryBackingStore::mapped(size_t index) const
+{
+	return huge_pages && page_length(index) == PAGE_LENGTH;
+}
+
+void
+MemoryBackingStore::release()
+{
+	for (size_t i = 0; i < pages.size(); ++i) {
+		if (pages[i] == nullptr) {
+			continue;
+		}
+		if (mapped(i)) {
+			munmap(pages[i], PAGE_LENGTH);
+		}
+		else {
+			free(pages[i]);
+		}
+	}
+	pages.clear();
+}
+
+void
+MemoryBackingStore::resize(unsigned long long size)
+{
+	release();
+	length = size;
+	pages.assign((size + PAGE_LENGTH - 1) >> PAGE_SHIFT, nullptr);
+}
+
+unsigned long long
+MemoryBackingStore::size() const
+{
+	return length;
+}
+
+bool
+MemoryBackingStore::write(const void * data, size_t size, unsigned long long offset)
+{
+	char const * p = static_cast<char const *>(data);
+	while (size > 0) {
+		size_t index = offset >> PAGE_SHIFT;
+		size_t within = offset & (PAGE_LENGTH - 1);
+		size_t count = std::min(size, page_length(index) - within);
+		char * & page = pages[index];
+		if (page == nullptr) {
+			if (mapped(index)) {
+				void * map = mmap(nullptr, PAGE_LENGTH, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if (map != MAP_FAILED) {
+					#if defined(MADV_HUGEPAGE)
+					madvise(map, PAGE_LENGTH, MADV_HUGEPAGE);
+					#endif
+					page = static_cast<char *>(map);
+				}
+			}
+			else {
+				page = static_cast<char *>(malloc(page_length(index)));
+			}
+			if (page == nullptr) {
+				LOG(ERROR) << "Can't allocate a page of " << page_length(index) << " bytes" << Logger::endl;
+				return false;
+			}
+		}
+		memcpy(page + within, p, count);
+		p += count;
+		offset += count;
+		size -= count;
+	}
+	return true;
+}
+
+bool
+MemoryBackingStore::read(void * buf, size_t size, unsigned long long offset) const
+{
+	char * p = static_cast<char *>(buf);
+	while (size > 0) {
+		size_t count;
+		char const * data = this->data(offset, count);
+		count = std::min(size, count);
+		memcpy(p, data, count);
+		p += count;
+		offset += count;
+		size -= count;
+	}
+	return true;
+}
+
+char const *
+MemoryBackingStore::data(unsigned long long offset, size_t & contiguous) const
+{
+	size_t index = offset >> PAGE_SHIFT;
+	size_t within = offset & (PAGE_LENGTH - 1);
+	contiguous = page_length(index) - within;
+	return (pages[index] != nullptr ? pages[index] : zero_page) + within;
+}
+
+FileBackingStore::FileBackingStore(std::string const & dir) :
+	length(0)
+{
+	std::string path = dir;
+	if (path.empty()) {
+		char const * tmp = getenv("TMPDIR");
+		path = tmp ? tmp : "/tmp";
+	}
+
+	#if defined(O_TMPFILE)
+	fd = ::open(path.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0)
+	#endif
+	{
+		std::string name = path + "/fuse-7z-ng.XXXXXX";
+		fd = mkstemp(&name[0]);
+		if (fd >= 0) {
+			unlink(name.c_str());
+		}
+	}
+	if (fd < 0) {
+		std::stringstream ss;
+		ss << "Can't create spill file in " << path << ": " << strerror(errno);
+		throw std::runtime_error(ss.str());
+	}
+}
+
+FileBackingStore::~FileBackingStore()
+{
+	close(fd);
+}
+
+void
+FileBackingStore::resize(unsigned long long size)
+{
+	if (ftruncate(fd, size) != 0) {
+		std::stringstream ss;
+		ss << "Can't resize spill file to " << size << ": " << strerror(errno);
+		throw std::runtime_error(ss.str());
+	}
+	length = size;
+}
+
+unsigned long long
+FileBackingStore::size() const
+{
+	return length;
+}
+
+bool
+FileBackingStore::write(const void * data, size_t size, unsigned long long offset)
+{
+	char const * p = static_cast<char const *>(data);
+	while (size > 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			LOG(ERROR) << "Spill file write failed: " << strerror(errno) << Logger::endl;
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool
+FileBackingStore::read(void * buf, size_t size, unsigned long long offset) const
+{
+	char * p = static_cast<char *>(buf);
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+int
+FileBackingStore::descriptor() const
+{
+	return fd;
+}
+
+CompressedBackingStore::CompressedBackingStore(unsigned long long length) :
+	length(length)
+{
+}
+
+void
+CompressedBackingStore::resize(unsigned long long size)
+{
+	if (size != length) {
+		throw std::logic_error("A compressed entry can't be resized");
+	}
+}
+
+unsigned long long
+CompressedBackingStore::size() const
+{
+	return length;
+}
+
+bool
+CompressedBackingStore::write(const void *, size_t, unsigned long long)
+{
+	return false;
+}
+
+#ifdef HAVE_LZ4
+
+CompressedBackingStore *
+CompressedBackingStore::compress(BackingStore const & from)
+{
+	CompressedBackingStore * store = new CompressedBackingStore(from.size());
+	std::vector<char> page(PAGE_LENGTH);
+	for (unsigned long long offset = 0; offset < store->length; offset += PAGE_LENGTH) {
+		size_t size = std::min((unsigned long long)PAGE_LENGTH, store->length - offset);
+		size_t contiguous = 0;
+		char const * data = from.data(offset, contiguous);
+		if (data == nullptr || contiguous < size) {
+			if (!from.read(&page[0], size, offset)) {
+				delete store;
+				return nullptr;
+			}
+			data = &page[0];
+		}
+
+		size_t at = store->pages.size();
+		store->offsets.push_back(at);
+		store->pages.resize(at + size);
+		// a page stored whole is not compressed
+		int packed = LZ4_compress_default(data, &store->pages[at], (int) size, (int) size - 1);
+		if (packed <= 0) {
+			memcpy(&store->pages[at], data, size);
+		}
+		else {
+			store->pages.resize(at + (size_t) packed);
+		}
+	}
+	store->offsets.push_back(store->pages.size());
+	store->pages.shrink_to_fit();
+	return store;
+}
+
+bool
+CompressedBackingStore::read(void * buf, size_t size, unsigned long long offset) const
+{
+	// pages read in part go through here, one per reading thread
+	static thread_local std::vector<char> scratch;
+	char * out = static_cast<char *>(buf);
+	while (size > 0) {
+		size_t index = offset / PAGE_LENGTH;
+		size_t within = offset % PAGE_LENGTH;
+		size_t page_size = std::min((unsigned long long)PAGE_LENGTH, length - index * PAGE_LENGTH);
+		size_t count = std::min(size, page_size - within);
+		char const * page = &pages[offsets[index]];
+		size_t packed = offsets[index + 1] - offsets[index];
+		if (packed == page_size) {
+			memcpy(out, page + within, count);
+		}
+		else if (count == page_size) {
+			if (LZ4_decompress_safe(page, out, (int) packed, (int) page_size) != (int) page_size) {
+				return false;
+			}
+		}
+		else {
+			scratch.resize(PAGE_LENGTH);
+			if (LZ4_decompress_safe(page, &scratch[0], (int) packed, (int) page_size) != (int) page_size) {
+				return false;
+			}
+			memcpy(out, &scratch[within], count);
+		}
+		out += count;
+		offset += count;
+		size -= count;
+	}
+	return true;
+}
+
+#else
+
+CompressedBackingStore *
+CompressedBackingStore::compress(BackingStore const &)
+{
+	return nullptr;
+}
+
+bool
+CompressedBackingStore::read(void *, size_t, unsigned long long) const
+{
+	return false;
+}
+
+#endif
+
+unsigned long long
+CompressedBackingStore::memory() const
+{
+	return pages.capacity() + offsets.capacity() * sizeof(offsets[0]);
+}
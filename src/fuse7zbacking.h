@@ -0,0 +1,159 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/**
+ * Where the decoded bytes of an entry live.
+ */
+class BackingStore
+{
+	public:
+	virtual ~BackingStore() {}
+
+	/**
+	 * Set the size of the entry, throws std::bad_alloc / std::runtime_error.
+	 */
+	virtual void resize(unsigned long long size) = 0;
+
+	virtual unsigned long long size() const = 0;
+
+	/**
+	 * Store size bytes at offset, the range must be within size().
+	 * @return false on I/O error
+	 */
+	virtual bool write(const void * data, size_t size, unsigned long long offset) = 0;
+
+	/**
+	 * Load size bytes from offset, the range must be within size().
+	 * @return false on I/O error
+	 */
+	virtual bool read(void * buf, size_t size, unsigned long long offset) const = 0;
+
+	/**
+	 * The bytes from offset on, if they can be handed out in place.
+	 * @param contiguous set to how many of them follow in memory
+	 * @return nullptr if the store has none in memory
+	 */
+	virtual char const * data(unsigned long long /* offset */, size_t & /* contiguous */) const { return nullptr; }
+
+	/**
+	 * @return a descriptor to pread() or splice() the bytes from, -1 if none
+	 */
+	virtual int descriptor() const { return -1; }
+
+	/**
+	 * Pick the store for an entry of the given size: memory below the
+	 * threshold, an anonymous file in spill_dir above it.
+	 * @param huge_pages map the memory pages, backed by huge pages if the
+	 *        kernel has them
+	 */
+	static BackingStore * create(unsigned long long size, unsigned long long threshold, std::string const & spill_dir,
+			bool huge_pages = false);
+};
+
+/**
+ * Entry decoded in memory, in pages allocated on their first write: nothing
+ * is zero-filled up front and no entry needs one contiguous allocation.
+ * The page of an offset is found by a shift.
+ */
+class MemoryBackingStore : public BackingStore
+{
+	public:
+	static const int PAGE_SHIFT = 21;
+	static const size_t PAGE_LENGTH = (size_t) 1 << PAGE_SHIFT;
+
+	/**
+	 * @param huge_pages the full pages are anonymous mappings, which the
+	 *        kernel may back with transparent huge pages
+	 */
+	MemoryBackingStore(bool huge_pages = false);
+	virtual ~MemoryBackingStore();
+
+	virtual void resize(unsigned long long size);
+	virtual unsigned long long size() const;
+	virtual bool write(const void * data, size_t size, unsigned long long offset);
+	virtual bool read(void * buf, size_t size, unsigned long long offset) const;
+	virtual char const * data(unsigned long long offset, size_t & contiguous) const;
+
+	private:
+	size_t page_length(size_t index) const;
+	bool mapped(size_t index) const;
+	void release();
+
+	bool const huge_pages;
+	unsigned long long length;
+	// nullptr until written
+	std::vector<char *> pages;
+};
+
+/**
+ * Sparse file which is unlinked right after creation, so it goes away with
+ * the descriptor even if the process gets killed.
+ */
+class FileBackingStore : public BackingStore
+{
+	int fd;
+	unsigned long long length;
+
+	public:
+	FileBackingStore(std::string const & dir);
+	virtual ~FileBackingStore();
+
+	virtual void resize(unsigned long long size);
+	virtual unsigned long long size() const;
+	virtual bool write(const void * data, size_t size, unsigned long long offset);
+	virtual bool read(void * buf, size_t size, unsigned long long offset) const;
+	virtual int descriptor() const;
+};
+
+/**
+ * Complete entry kept compressed in memory by liblz4, in pages read()
+ * decompresses on demand. Pages which don't compress are kept as they are. Read-only.
+ */
+class CompressedBackingStore : public BackingStore
+{
+	public:
+	static const size_t PAGE_LENGTH = 64 * 1024;
+
+	/**
+	 * Compress the content of another store.
+	 * @return nullptr if it can't be read or liblz4 is not built in
+	 */
+	static CompressedBackingStore * compress(BackingStore const & from);
+
+	virtual void resize(unsigned long long size);
+	virtual unsigned long long size() const;
+	virtual bool write(const void * data, size_t size, unsigned long long offset);
+	virtual bool read(void * buf, size_t size, unsigned long long offset) const;
+
+	/**
+	 * Bytes held by the compressed pages.
+	 */
+	unsigned long long memory() const;
+
+	private:
+	CompressedBackingStore(unsigned long long length);
+
+	unsigned long long length;
+	// the pages one after the other, page i at offsets[i]
+	std::vector<char> pages;
+	std::vector<unsigned long long> offsets;
+};
@@ -0,0 +1,275 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "fuse7zcache.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+Fuse7zCache::Fuse7zCache(Fuse7zOptions const & options) :
+	budget(options.cache_size),
+	unused_size(0),
+	packed_budget(options.compressed_cache),
+	packed_size(0),
+	spill_threshold(options.spill_threshold),
+	spill_dir(options.spill_dir),
+	huge_pages(options.huge_pages)
+{
+#ifndef HAVE_LZ4
+	if (packed_budget > 0) {
+		LOG(WARNING) << "Built without liblz4, ignoring compressed_cache" << Logger::endl;
+		packed_budget = 0;
+	}
+#endif
+}
+
+Fuse7zCache::~Fuse7zCache()
+{
+	clear();
+}
+
+Fuse7zOutStream *
+Fuse7zCache::acquire(key_t key, unsigned long long size, unsigned long long skipped, bool & created)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	entries_t::iterator i = entries.find(key);
+	if (i != entries.end()) {
+		Entry & entry = i->second;
+		if (entry.refs++ == 0) {
+			(entry.packed ? packed_size : unused_size) -= weight(entry);
+			(entry.packed ? packed_lru : lru).erase(entry.lru);
+			if (entry.packed) {
+				// opened again, read it from memory rather than decompress
+				// every read
+				Fuse7zOutStream * stream = entry.stream;
+				lock.unlock();
+				Fuse7zOutStream * unused = unpack(stream);
+				lock.lock();
+				i = entries.find(key);
+				// unless opened meanwhile with the compressed one
+				if (unused != nullptr && i != entries.end() && i->second.stream == stream && i->second.refs == 1) {
+					i->second.stream = unused;
+					i->second.packed = false;
+					std::swap(stream, unused);
+				}
+				lock.unlock();
+				delete unused;
+				created = false;
+				return stream;
+			}
+		}
+		created = false;
+		return entry.stream;
+	}
+
+	Fuse7zOutStream * stream = new Fuse7zOutStream(BackingStore::create(size, spill_threshold, spill_dir, huge_pages));
+	Entry & entry = entries[key];
+	entry.stream = stream;
+	entry.refs = 1;
+	entry.skipped = skipped;
+	entry.packed = false;
+	created = true;
+	return stream;
+}
+
+void
+Fuse7zCache::release(key_t key)
+{
+	evicted_t evicted;
+	Fuse7zOutStream * abandoned = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries_t::iterator i = entries.find(key);
+		if (i == entries.end()) {
+			return;
+		}
+		Entry & entry = i->second;
+		if (--entry.refs > 0) {
+			return;
+		}
+		if (!entry.stream->complete()) {
+			// nobody waits for the rest of it, stop decoding; it never made it
+			// to the unused list, so drop() doesn't apply
+			abandoned = entry.stream;
+			entries.erase(i);
+		}
+		else if (entry.packed) {
+			packed_lru.push_front(key);
+			entry.lru = packed_lru.begin();
+			packed_size += weight(entry);
+			evict_packed();
+		}
+		else {
+			lru.push_front(key);
+			entry.lru = lru.begin();
+			unused_size += weight(entry);
+			evict(true, evicted);
+			evict(false, evicted);
+		}
+	}
+	// joins the extraction, which may be deep in a solid block: not with
+	// the whole cache locked
+	delete abandoned;
+	pack(evicted);
+}
+
+void
+Fuse7zCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	// the extraction of a nested archive entry may read another entry,
+	// none may go away before all of them stopped
+	for (entries_t::iterator i = entries.begin(); i != entries.end(); ++i) {
+		i->second.stream->cancel();
+	}
+	for (entries_t::iterator i = entries.begin(); i != entries.end(); ++i) {
+		delete i->second.stream;
+	}
+	entries.clear();
+	lru.clear();
+	unused_size = 0;
+	packed_lru.clear();
+	packed_size = 0;
+}
+
+void
+Fuse7zCache::usage(size_t & count, unsigned long long & unused)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	count = entries.size();
+	unused = unused_size;
+}
+
+void
+Fuse7zCache::packed_usage(size_t & count, unsigned long long & decoded, unsigned long long & memory)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	count = 0;
+	decoded = 0;
+	memory = 0;
+	for (entries_t::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+		if (i->second.packed) {
+			++count;
+			decoded += i->second.stream->size();
+			memory += weight(i->second);
+		}
+	}
+}
+
+void
+Fuse7zCache::evict(bool cheap_only, evicted_t & evicted)
+{
+	std::list<key_t>::iterator i = lru.end();
+	while (unused_size > budget && i != lru.begin()) {
+		entries_t::iterator victim = entries.find(*--i);
+		if (cheap_only && victim->second.skipped > 0) {
+			continue;
+		}
+		i = lru.erase(i);
+		unused_size -= weight(victim->second);
+		evicted.push_back(*victim);
+		entries.erase(victim);
+	}
+}
+
+void
+Fuse7zCache::evict_packed()
+{
+	while (packed_size > packed_budget && !packed_lru.empty()) {
+		drop(entries.find(packed_lru.back()));
+	}
+}
+
+void
+Fuse7zCache::drop(entries_t::iterator i)
+{
+	Entry & entry = i->second;
+	if (entry.refs == 0) {
+		(entry.packed ? packed_size : unused_size) -= weight(entry);
+		(entry.packed ? packed_lru : lru).erase(entry.lru);
+	}
+	delete entry.stream;
+	entries.erase(i);
+}
+
+void
+Fuse7zCache::pack(evicted_t & evicted)
+{
+	for (evicted_t::iterator i = evicted.begin(); i != evicted.end(); ++i) {
+		Entry & entry = i->second;
+		BackingStore const * store = entry.stream->backing();
+		// a spilled entry doesn't take memory, an empty one no time to decode
+		CompressedBackingStore * packed = nullptr;
+		size_t contiguous;
+		if (store->size() > 0 && store->size() <= packed_budget && store->data(0, contiguous) != nullptr) {
+			packed = CompressedBackingStore::compress(*store);
+		}
+		delete entry.stream;
+		if (packed == nullptr) {
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (entries.find(i->first) != entries.end()) {
+			// opened again meanwhile, and being decoded again
+			delete packed;
+			continue;
+		}
+		entry.stream = new Fuse7zOutStream(packed, true);
+		entry.refs = 0;
+		entry.packed = true;
+		packed_lru.push_front(i->first);
+		entry.lru = packed_lru.begin();
+		packed_size += weight(entry);
+		entries.insert(*i);
+		evict_packed();
+	}
+}
+
+Fuse7zOutStream *
+Fuse7zCache::unpack(Fuse7zOutStream const * packed)
+{
+	BackingStore const * from = packed->backing();
+	BackingStore * store;
+	try {
+		store = BackingStore::create(from->size(), spill_threshold, spill_dir, huge_pages);
+	}
+	catch (std::exception const & e) {
+		LOG(WARNING) << "Can't decompress a cached entry: " << e.what() << Logger::endl;
+		return nullptr;
+	}
+	std::vector<char> page(CompressedBackingStore::PAGE_LENGTH);
+	for (unsigned long long offset = 0; offset < from->size(); offset += page.size()) {
+		size_t size = std::min((unsigned long long) page.size(), from->size() - offset);
+		if (!from->read(&page[0], size, offset) || !store->write(&page[0], size, offset)) {
+			delete store;
+			return nullptr;
+		}
+	}
+	return new Fuse7zOutStream(store, true);
+}
+
+unsigned long long
+Fuse7zCache::weight(Entry const & entry)
+{
+	if (entry.packed) {
+		return static_cast<CompressedBackingStore const *>(entry.stream->backing())->memory();
+	}
+	return entry.stream->size();
+}
@@ -0,0 +1,148 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "fuse7zstream.h"
+#include "options.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * Decoded entries of the mounted archives, keyed by archive and item id.
+ *
+ * Opens of the same entry share one Fuse7zOutStream (and so one extraction).
+ * Entries nobody has open stay in memory, least recently used first out,
+ * as long as they fit in the budget. Entries deep inside a solid block are
+ * expensive to decode again, so the ones which are cheap to rebuild go first.
+ *
+ * With a compressed_cache budget the entries evicted from memory are packed
+ * into compressed pages rather than dropped, and served from there until
+ * they are the least recently used ones of that budget too. An entry opened
+ * again goes back to memory.
+ */
+class Fuse7zCache
+{
+	public:
+	typedef unsigned long long key_t;
+
+	Fuse7zCache(Fuse7zOptions const & options);
+	~Fuse7zCache();
+
+	/**
+	 * @param archive serial number of the archive in the mount
+	 * @param id archive item id of the entry
+	 */
+	static key_t key(unsigned int archive, int id)
+	{
+		return ((key_t) archive << 32) | (unsigned int) id;
+	}
+
+	/**
+	 * Take a reference on the decoded entry 'key'.
+	 * @param skipped bytes the decoder goes through before reaching the entry
+	 *        (its offset in the solid block)
+	 * @param created set to true if the entry is new and the caller has to
+	 *        start its extraction
+	 */
+	Fuse7zOutStream * acquire(key_t key, unsigned long long size, unsigned long long skipped, bool & created);
+
+	/**
+	 * Drop a reference taken by acquire().
+	 */
+	void release(key_t key);
+
+	/**
+	 * Forget every entry, including the ones still open.
+	 */
+	void clear();
+
+	/**
+	 * Entries held, open or not, and the bytes of the unused ones.
+	 */
+	void usage(size_t & count, unsigned long long & unused);
+
+	/**
+	 * Compressed entries, their decoded size and the memory they take.
+	 */
+	void packed_usage(size_t & count, unsigned long long & decoded, unsigned long long & memory);
+
+	unsigned long long capacity() const
+	{
+		return budget;
+	}
+
+	unsigned long long packed_capacity() const
+	{
+		return packed_budget;
+	}
+
+	private:
+	struct Entry
+	{
+		Fuse7zOutStream * stream;
+		int refs;
+		unsigned long long skipped;
+		// the stream reads compressed pages, it counts against packed_budget
+		bool packed;
+		// in lru or packed_lru
+		std::list<key_t>::iterator lru;
+	};
+	typedef std::map<key_t, Entry> entries_t;
+	typedef std::vector<std::pair<key_t, Entry> > evicted_t;
+
+	/**
+	 * Unlink unused entries until they fit in the budget.
+	 */
+	void evict(bool cheap_only, evicted_t & evicted);
+	void evict_packed();
+	void drop(entries_t::iterator i);
+
+	/**
+	 * Compress the evicted entries which are worth it and delete the others,
+	 * without the lock.
+	 */
+	void pack(evicted_t & evicted);
+
+	/**
+	 * Decompress a packed entry back into a store of its own, without the
+	 * lock.
+	 * @return nullptr if it can't be read or stored
+	 */
+	Fuse7zOutStream * unpack(Fuse7zOutStream const * packed);
+
+	/**
+	 * Bytes an entry counts for in its budget.
+	 */
+	static unsigned long long weight(Entry const & entry);
+
+	std::mutex mutex;
+	entries_t entries;
+	// unused entries, the most recently released first
+	std::list<key_t> lru;
+	unsigned long long budget;
+	unsigned long long unused_size;
+	// unused compressed entries, the most recently released first
+	std::list<key_t> packed_lru;
+	unsigned long long packed_budget;
+	unsigned long long packed_size;
+	unsigned long long spill_threshold;
+	std::string spill_dir;
+	bool huge_pages;
+};
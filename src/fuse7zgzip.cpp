@@ -0,0 +1,574 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "fuse7zgzip.h"
+
+#include <cerrno>
+
+#ifdef HAVE_ZLIB
+
+#include "fuse7zindex.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static const char GZIP_MAGIC[8] = { 'F', '7', 'Z', 'G', 'Z', 'I', 'D', 'X' };
+static const uint32_t GZIP_VERSION = 1;
+// history deflate refers back to
+static const size_t WINDOW_SIZE = 32 * 1024;
+static const size_t INPUT_SIZE = 64 * 1024;
+// idle decoders kept for the next reads
+static const size_t IDLE_CURSORS = 4;
+
+namespace {
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t window_size;
+	uint64_t archive_size;
+	int64_t archive_mtime;
+	uint64_t archive_hash;
+	uint64_t count;
+	uint64_t total;
+};
+
+bool
+pread_all (int fd, void * buf, size_t size, off_t offset)
+{
+	char * p = static_cast<char *>(buf);
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool
+pwrite_all (int fd, void const * buf, size_t size, off_t offset)
+{
+	char const * p = static_cast<char const *>(buf);
+	while (size > 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+}
+
+struct GzipReader::Cursor
+{
+	Cursor() :
+		in(0),
+		out(0),
+		raw(false),
+		ended(false),
+		eof(false),
+		skip(0)
+	{
+		memset(&strm, 0, sizeof(strm));
+		memset(window, 0, sizeof(window));
+	}
+
+	~Cursor()
+	{
+		inflateEnd(&strm);
+	}
+
+	z_stream strm;
+	// offset in the file of the next input to read
+	unsigned long long in;
+	// decoded offset
+	unsigned long long out;
+	// resumed from a checkpoint: raw deflate, inflate leaves the gzip
+	// trailer of the member to skip
+	bool raw;
+	// between two members
+	bool ended;
+	bool eof;
+	// trailer bytes left to skip
+	unsigned int skip;
+	unsigned char input[INPUT_SIZE];
+	// the last decoded bytes, offset out is at out % WINDOW_SIZE
+	unsigned char window[WINDOW_SIZE];
+};
+
+GzipReader *
+GzipReader::create(int fd, std::string const & filename, Fuse7zOptions const & options)
+{
+	unsigned char magic[2];
+	if (!pread_all(fd, magic, sizeof(magic), 0) || magic[0] != 0x1f || magic[1] != 0x8b) {
+		return nullptr;
+	}
+
+	GzipReader * reader = new GzipReader(fd, filename, options);
+	if (reader->load()) {
+		LOG(INFO) << "Checkpoints loaded from " << reader->path << Logger::endl;
+		return reader;
+	}
+	if (!reader->path.empty()) {
+		reader->windows_path = reader->path + ".XXXXXX";
+		reader->windows_fd = mkstemp(&reader->windows_path[0]);
+		if (reader->windows_fd >= 0) {
+			return reader;
+		}
+		LOG(WARNING) << "Can't save checkpoints in " << reader->path << ": " << strerror(errno) << Logger::endl;
+		reader->windows_path.clear();
+	}
+
+	std::string dir = options.spill_dir;
+	if (dir.empty()) {
+		char const * tmp = getenv("TMPDIR");
+		dir = tmp ? tmp : "/tmp";
+	}
+	#if defined(O_TMPFILE)
+	reader->windows_fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (reader->windows_fd < 0)
+	#endif
+	{
+		std::string name = dir + "/fuse-7z-ng.XXXXXX";
+		reader->windows_fd = mkstemp(&name[0]);
+		if (reader->windows_fd >= 0) {
+			unlink(name.c_str());
+		}
+	}
+	if (reader->windows_fd < 0) {
+		// still readable, from the start of the file every time
+		LOG(WARNING) << "Can't create the checkpoint file in " << dir << ": " << strerror(errno) << Logger::endl;
+		reader->failed = true;
+	}
+	return reader;
+}
+
+GzipReader::GzipReader(int fd, std::string const & filename, Fuse7zOptions const & options) :
+	fd(fd),
+	filename(filename),
+	span(std::max(options.checkpoint_span, (unsigned long long)WINDOW_SIZE)),
+	windows_fd(-1),
+	loaded(false),
+	failed(false),
+	complete(false),
+	total(0),
+	stopping(false)
+{
+	if (!options.index_cache.empty()) {
+		path = IndexCache::saved(options.index_cache, filename, ".gzi");
+	}
+}
+
+GzipReader::~GzipReader()
+{
+	stopping = true;
+	if (finisher.joinable()) {
+		finisher.join();
+	}
+	for (Cursor * cursor : idle) {
+		delete cursor;
+	}
+	save();
+	if (windows_fd >= 0) {
+		::close(windows_fd);
+	}
+	if (!windows_path.empty()) {
+		unlink(windows_path.c_str());
+	}
+}
+
+bool
+GzipReader::load()
+{
+	if (path.empty()) {
+		return false;
+	}
+	Header expected;
+	memset(&expected, 0, sizeof(expected));
+	if (!IndexCache::fingerprint(filename, expected.archive_size, expected.archive_mtime, expected.archive_hash)) {
+		return false;
+	}
+	int saved = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (saved < 0) {
+		return false;
+	}
+	Header header;
+	struct stat st;
+	bool ok = fstat(saved, &st) == 0
+		&& pread_all(saved, &header, sizeof(header), 0)
+		&& memcmp(header.magic, GZIP_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == GZIP_VERSION
+		&& header.window_size == WINDOW_SIZE
+		&& header.archive_size == expected.archive_size
+		&& header.archive_mtime == expected.archive_mtime
+		&& header.archive_hash == expected.archive_hash
+		&& sizeof(Header) + header.count * (WINDOW_SIZE + sizeof(Checkpoint)) == (uint64_t)st.st_size;
+	if (ok) {
+		checkpoints.resize(header.count);
+		ok = header.count == 0
+			|| pread_all(saved, checkpoints.data(), header.count * sizeof(Checkpoint), sizeof(Header) + header.count * WINDOW_SIZE);
+	}
+	if (!ok) {
+		LOG(INFO) << "Ignoring stale checkpoints " << path << Logger::endl;
+		checkpoints.clear();
+		::close(saved);
+		return false;
+	}
+	windows_fd = saved;
+	loaded = true;
+	complete = true;
+	total = header.total;
+	return true;
+}
+
+void
+GzipReader::save()
+{
+	if (!complete || loaded || windows_path.empty() || failed) {
+		return;
+	}
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GZIP_MAGIC, sizeof(header.magic));
+	header.version = GZIP_VERSION;
+	header.window_size = WINDOW_SIZE;
+	header.count = checkpoints.size();
+	header.total = total;
+	bool ok = IndexCache::fingerprint(filename, header.archive_size, header.archive_mtime, header.archive_hash)
+		&& (checkpoints.empty()
+			|| pwrite_all(windows_fd, checkpoints.data(), checkpoints.size() * sizeof(Checkpoint), sizeof(Header) + checkpoints.size() * WINDOW_SIZE))
+		&& pwrite_all(windows_fd, &header, sizeof(header), 0);
+	// renamed once complete, concurrent mounts never see a partial file
+	if (!ok || rename(windows_path.c_str(), path.c_str()) != 0) {
+		LOG(WARNING) << "Can't save checkpoints in " << path << ": " << strerror(errno) << Logger::endl;
+		return;
+	}
+	windows_path.clear();
+	LOG(INFO) << checkpoints.size() << " checkpoints saved to " << path << Logger::endl;
+}
+
+bool
+GzipReader::size(unsigned long long & size) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	size = total;
+	return complete;
+}
+
+int
+GzipReader::read(char * buf, size_t size, off_t offset)
+{
+	// the count goes back as an int, a nested archive reader gets a short read
+	size = std::min(size, (size_t) INT_MAX);
+	unsigned long long begin = offset;
+	unsigned long long end = begin + size;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (size == 0 || (complete && begin >= total)) {
+			return 0;
+		}
+	}
+
+	Cursor * cursor = take(begin);
+	if (cursor == nullptr) {
+		return -EIO;
+	}
+	while (cursor->out < end && !cursor->eof) {
+		int err = step(cursor, buf, begin, end);
+		if (err != 0) {
+			delete cursor;
+			return err;
+		}
+	}
+	// at most size, within an int
+	int done = cursor->out > begin ? (int) (std::min(cursor->out, end) - begin) : 0;
+	give(cursor);
+	return done;
+}
+
+void
+GzipReader::finish(sized_t const & sized)
+{
+	finisher = std::thread(&GzipReader::run, this, sized);
+}
+
+void
+GzipReader::run(sized_t sized)
+{
+	// from the last checkpoint, or a decoder past it
+	Cursor * cursor = take(ULLONG_MAX);
+	while (cursor != nullptr && !cursor->eof && !stopping) {
+		if (step(cursor, nullptr, 0, 0) != 0) {
+			delete cursor;
+			return;
+		}
+	}
+	if (cursor == nullptr || !cursor->eof) {
+		give(cursor);
+		return;
+	}
+	delete cursor;
+
+	unsigned long long size;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		save();
+		size = total;
+	}
+	LOG(INFO) << filename << " decodes to " << size << " bytes" << Logger::endl;
+	sized(size);
+}
+
+GzipReader::Cursor *
+GzipReader::take(unsigned long long offset)
+{
+	Checkpoint point;
+	bool resume;
+	size_t index;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<Checkpoint>::const_iterator it = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+				[] (unsigned long long offset, Checkpoint const & point) { return offset < point.out; });
+		resume = it != checkpoints.begin();
+		index = resume ? it - checkpoints.begin() - 1 : 0;
+		if (resume) {
+			point = checkpoints[index];
+		}
+
+		// a decoder between the checkpoint and offset is closer
+		std::vector<Cursor *>::iterator best = idle.end();
+		for (std::vector<Cursor *>::iterator c = idle.begin(); c != idle.end(); ++c) {
+			if ((*c)->out <= offset && (!resume || (*c)->out >= point.out)
+					&& (best == idle.end() || (*c)->out > (*best)->out)) {
+				best = c;
+			}
+		}
+		if (best != idle.end()) {
+			Cursor * cursor = *best;
+			idle.erase(best);
+			return cursor;
+		}
+	}
+
+	Cursor * cursor = new Cursor();
+	if (!resume) {
+		if (inflateInit2(&cursor->strm, 31) != Z_OK) {
+			delete cursor;
+			return nullptr;
+		}
+		return cursor;
+	}
+
+	std::vector<unsigned char> window(WINDOW_SIZE);
+	unsigned char byte = 0;
+	bool ok = inflateInit2(&cursor->strm, -15) == Z_OK
+		&& pread_all(windows_fd, &window[0], WINDOW_SIZE, sizeof(Header) + index * WINDOW_SIZE)
+		&& (point.bits == 0 || pread_all(fd, &byte, 1, point.in - 1))
+		&& (point.bits == 0 || inflatePrime(&cursor->strm, point.bits, byte >> (8 - point.bits)) == Z_OK)
+		&& inflateSetDictionary(&cursor->strm, &window[0], WINDOW_SIZE) == Z_OK;
+	if (!ok) {
+		LOG(ERROR) << "Can't resume " << filename << " at checkpoint " << index << Logger::endl;
+		delete cursor;
+		return nullptr;
+	}
+	cursor->raw = true;
+	cursor->in = point.in;
+	cursor->out = point.out;
+	size_t at = point.out % WINDOW_SIZE;
+	memcpy(cursor->window + at, &window[0], WINDOW_SIZE - at);
+	memcpy(cursor->window, &window[WINDOW_SIZE - at], at);
+	return cursor;
+}
+
+void
+GzipReader::give(Cursor * cursor)
+{
+	if (cursor == nullptr || cursor->eof) {
+		delete cursor;
+		return;
+	}
+	Cursor * dropped = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.push_back(cursor);
+		if (idle.size() > IDLE_CURSORS) {
+			dropped = idle.front();
+			idle.erase(idle.begin());
+		}
+	}
+	delete dropped;
+}
+
+int
+GzipReader::step(Cursor * cursor, char * buf, unsigned long long begin, unsigned long long end)
+{
+	z_stream & strm = cursor->strm;
+	if (strm.avail_in == 0) {
+		ssize_t n;
+		do {
+			n = pread(fd, cursor->input, INPUT_SIZE, cursor->in);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			return -errno;
+		}
+		if (n == 0) {
+			if (!cursor->ended) {
+				LOG(ERROR) << "Truncated gzip file " << filename << Logger::endl;
+				return -EIO;
+			}
+			cursor->eof = true;
+		}
+		else {
+			cursor->in += n;
+			strm.next_in = cursor->input;
+			strm.avail_in = (uInt) n;
+		}
+	}
+
+	if (cursor->ended && !cursor->eof) {
+		unsigned int skip = std::min(cursor->skip, strm.avail_in);
+		strm.next_in += skip;
+		strm.avail_in -= skip;
+		cursor->skip -= skip;
+		if (cursor->skip > 0 || strm.avail_in == 0) {
+			return 0;
+		}
+		if (strm.next_in[0] != 0x1f) {
+			// padding after the last member, which gzip ignores too
+			cursor->eof = true;
+		}
+		else {
+			inflateReset2(&strm, 31);
+			cursor->raw = false;
+			cursor->ended = false;
+		}
+	}
+	if (cursor->eof) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!complete) {
+			complete = true;
+			total = cursor->out;
+		}
+		return 0;
+	}
+
+	size_t at = cursor->out % WINDOW_SIZE;
+	strm.next_out = cursor->window + at;
+	strm.avail_out = (uInt) (WINDOW_SIZE - at);
+	int ret = inflate(&strm, Z_BLOCK);
+	size_t produced = WINDOW_SIZE - at - strm.avail_out;
+	unsigned long long from = std::max(cursor->out, begin);
+	unsigned long long to = std::min(cursor->out + produced, end);
+	if (from < to) {
+		memcpy(buf + (from - begin), cursor->window + at + (from - cursor->out), to - from);
+	}
+	cursor->out += produced;
+
+	if (ret == Z_STREAM_END) {
+		cursor->ended = true;
+		cursor->skip = cursor->raw ? 8 : 0;
+		return 0;
+	}
+	if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		LOG(ERROR) << "Corrupted gzip data in " << filename << " after " << cursor->out << " bytes" << Logger::endl;
+		return -EIO;
+	}
+	// at the start of a deflate block which is not the last one
+	if ((strm.data_type & 128) != 0 && (strm.data_type & 64) == 0) {
+		checkpoint(cursor);
+	}
+	return 0;
+}
+
+void
+GzipReader::checkpoint(Cursor * cursor)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (loaded || failed || complete
+			|| (!checkpoints.empty() && cursor->out < checkpoints.back().out + span)) {
+		return;
+	}
+	// the window ending at out, oldest byte first
+	unsigned char window[WINDOW_SIZE];
+	size_t at = cursor->out % WINDOW_SIZE;
+	memcpy(window, cursor->window + at, WINDOW_SIZE - at);
+	memcpy(window + WINDOW_SIZE - at, cursor->window, at);
+	if (!pwrite_all(windows_fd, window, WINDOW_SIZE, sizeof(Header) + checkpoints.size() * WINDOW_SIZE)) {
+		LOG(WARNING) << "Can't write the checkpoints of " << filename << ": " << strerror(errno) << Logger::endl;
+		failed = true;
+		return;
+	}
+	Checkpoint point;
+	memset(&point, 0, sizeof(point));
+	point.out = cursor->out;
+	point.in = cursor->in - cursor->strm.avail_in;
+	point.bits = cursor->strm.data_type & 7;
+	checkpoints.push_back(point);
+}
+
+#else
+
+GzipReader *
+GzipReader::create(int, std::string const &, Fuse7zOptions const &)
+{
+	return nullptr;
+}
+
+GzipReader::~GzipReader()
+{
+}
+
+int
+GzipReader::read(char *, size_t, off_t)
+{
+	return -ENOTSUP;
+}
+
+void
+GzipReader::finish(sized_t const &)
+{
+}
+
+bool
+GzipReader::size(unsigned long long &) const
+{
+	return false;
+}
+
+#endif
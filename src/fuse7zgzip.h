@@ -0,0 +1,154 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "options.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Random access into a gzip file, without decoding it from the start.
+ *
+ * The reads that get past the last checkpoint leave one every
+ * checkpoint_span decoded bytes: where the deflate block starts in the
+ * file and the 32K window inflate needs to resume there. A read then only
+ * decodes from the checkpoint before it, or continues a decoder a previous
+ * read left where it starts. The windows are kept in a file, in memory a
+ * checkpoint takes a few words; with an index_cache the file is kept once
+ * it covers the whole gzip file and the next mount starts with it.
+ */
+class GzipReader
+{
+	public:
+	/**
+	 * @param fd the gzip file, which stays owned by the caller
+	 * @return nullptr if fd is not a gzip file or zlib is not built in
+	 */
+	static GzipReader * create(int fd, std::string const & filename, Fuse7zOptions const & options);
+
+	~GzipReader();
+
+	/**
+	 * Decode [offset, offset + size) into buf.
+	 * @return the bytes decoded, short at the end and at most INT_MAX, or -errno
+	 */
+	int read(char * buf, size_t size, off_t offset);
+
+	/**
+	 * Decoded size, known once a read or finish() reached the end, or from
+	 * a saved index;
+	 * the gzip trailer only has it modulo 4G.
+	 * @return false if not known yet
+	 */
+	bool size(unsigned long long & size) const;
+
+	typedef std::function<void(unsigned long long size)> sized_t;
+
+	/**
+	 * Decode the rest of the file in the background: it leaves the
+	 * checkpoints of the whole file, saved at once, and the decoded size,
+	 * handed to sized. The reads stop at the size the trailer reports, they
+	 * would never get past it to the end.
+	 */
+	void finish(sized_t const & sized);
+
+	private:
+	struct Checkpoint
+	{
+		// decoded offset
+		uint64_t out;
+		// offset in the file of the first byte not fully consumed
+		uint64_t in;
+		// bits of the byte before in which are still to be decoded
+		uint32_t bits;
+		uint32_t padding;
+	};
+
+	struct Cursor;
+
+	GzipReader(int fd, std::string const & filename, Fuse7zOptions const & options);
+
+	/**
+	 * Load the saved checkpoints of a complete index.
+	 */
+	bool load();
+
+	/**
+	 * Keep the checkpoints if they cover the whole file.
+	 */
+	void save();
+
+	/**
+	 * A decoder to read from offset on: an idle one at or before it, else
+	 * a new one from the checkpoint before it.
+	 */
+	Cursor * take(unsigned long long offset);
+
+	/**
+	 * Keep the decoder for the next read, nullptr-safe.
+	 */
+	void give(Cursor * cursor);
+
+	/**
+	 * Decode the next chunk, copying what falls in [begin, end) into buf.
+	 * @return 0 or -errno
+	 */
+	int step(Cursor * cursor, char * buf, unsigned long long begin, unsigned long long end);
+
+	/**
+	 * Record a checkpoint where the cursor is if it is a span past the last.
+	 */
+	void checkpoint(Cursor * cursor);
+
+	/**
+	 * The finish() thread.
+	 */
+	void run(sized_t sized);
+
+	int const fd;
+	std::string const filename;
+	unsigned long long const span;
+	// the saved checkpoints, empty without an index_cache
+	std::string path;
+	// the windows of the checkpoints after a header, then once complete
+	// the checkpoints: the file saved at path
+	int windows_fd;
+	// where the windows file is written before being renamed to path
+	std::string windows_path;
+	// the windows file is the saved one, complete and read-only
+	bool loaded;
+	// a window could not be written, no more checkpoints are recorded
+	bool failed;
+
+	mutable std::mutex mutex;
+	std::vector<Checkpoint> checkpoints;
+	// decoders left by the reads, most recent last
+	std::vector<Cursor *> idle;
+	// a read decoded to the end, the checkpoints cover the whole file
+	bool complete;
+	unsigned long long total;
+
+	std::thread finisher;
+	std::atomic<bool> stopping;
+};
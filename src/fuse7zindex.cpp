@@ -0,0 +1,246 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zindex.h"
+#include "logger.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char INDEX_MAGIC[8] = { 'F', '7', 'Z', 'I', 'N', 'D', 'E', 'X' };
+static const uint32_t INDEX_VERSION = 3;
+// bytes of the archive head and tail which go into the hash
+static const size_t HASH_SPAN = 64 * 1024;
+
+static uint64_t
+fnv1a (void const * data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+	unsigned char const * p = static_cast<unsigned char const *>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+IndexCache::IndexCache(std::string const & dir, std::string const & archive) :
+	archive(archive),
+	path(saved(dir, archive, ".idx"))
+{
+}
+
+std::string
+IndexCache::saved(std::string const & dir, std::string const & archive, char const * extension)
+{
+	char * real = realpath(archive.c_str(), nullptr);
+	std::string key = real ? real : archive;
+	free(real);
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx", (unsigned long long)fnv1a(key.data(), key.size()));
+	return dir + name + extension;
+}
+
+bool
+IndexCache::fingerprint(std::string const & archive, uint64_t & size, int64_t & mtime, uint64_t & hash)
+{
+	int fd = ::open(archive.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+	size = st.st_size;
+	mtime = st.st_mtime;
+
+	// the headers of most formats are at one of the ends
+	std::vector<char> buf(HASH_SPAN);
+	ssize_t n = pread(fd, &buf[0], buf.size(), 0);
+	hash = fnv1a(&buf[0], n > 0 ? n : 0);
+	off_t tail = st.st_size > (off_t)HASH_SPAN ? st.st_size - HASH_SPAN : 0;
+	n = pread(fd, &buf[0], buf.size(), tail);
+	hash = fnv1a(&buf[0], n > 0 ? n : 0, hash);
+	::close(fd);
+	return true;
+}
+
+bool
+IndexCache::stamp(Header & header) const
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.version = INDEX_VERSION;
+	header.record_size = sizeof(Record);
+
+	return fingerprint(archive, header.archive_size, header.archive_mtime, header.archive_hash);
+}
+
+bool
+IndexCache::load(NodeTree & tree)
+{
+	Header expected;
+	if (!stamp(expected)) {
+		return false;
+	}
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+		::close(fd);
+		return false;
+	}
+	void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	Header const * header = static_cast<Header const *>(map);
+	bool ok = memcmp(header->magic, expected.magic, sizeof(header->magic)) == 0
+		&& header->version == expected.version
+		&& header->record_size == expected.record_size
+		&& header->archive_size == expected.archive_size
+		&& header->archive_mtime == expected.archive_mtime
+		&& header->archive_hash == expected.archive_hash
+		&& sizeof(Header) + header->count * sizeof(Record) + header->names_size == (uint64_t)st.st_size;
+	if (!ok) {
+		LOG(INFO) << "Ignoring stale index " << path << Logger::endl;
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	Record const * records = reinterpret_cast<Record const *>(header + 1);
+	char const * names = reinterpret_cast<char const *>(records + header->count);
+	std::vector<Node *> nodes(header->count);
+	for (uint64_t i = 0; i < header->count; ++i) {
+		Record const & r = records[i];
+		Node * node;
+		if (i == 0) {
+			node = tree.root();
+		}
+		else {
+			if (r.parent >= i || r.name_offset + (uint64_t)r.name_size > header->names_size) {
+				ok = false;
+				break;
+			}
+			node = tree.add_child(nodes[r.parent], names + r.name_offset, r.name_size);
+		}
+		nodes[i] = node;
+		node->id = r.id;
+		node->is_dir = r.is_dir != 0;
+		node->block = r.block;
+		node->block_offset = r.block_offset;
+		node->data_offset = r.data_offset;
+		node->size = r.size;
+		node->atime.tv_sec = r.atime;
+		node->atime.tv_nsec = r.atime_nsec;
+		node->ctime.tv_sec = r.ctime;
+		node->ctime.tv_nsec = r.ctime_nsec;
+		node->mtime.tv_sec = r.mtime;
+		node->mtime.tv_nsec = r.mtime_nsec;
+	}
+	munmap(map, st.st_size);
+	if (!ok) {
+		LOG(WARNING) << "Corrupted index " << path << Logger::endl;
+		tree.clear();
+		return false;
+	}
+	tree.finalize();
+	return true;
+}
+
+void
+IndexCache::save(NodeTree & tree)
+{
+	Header header;
+	if (!stamp(header)) {
+		return;
+	}
+
+	std::vector<Record> records;
+	std::string names;
+	// in inode order: load() creates the nodes in the same order, which
+	// gives them the same inodes
+	records.reserve(tree.size());
+	for (size_t ino = 1; ino <= tree.size(); ++ino) {
+		Node const * node = tree.at((unsigned int) ino);
+		Record r;
+		memset(&r, 0, sizeof(r));
+		r.parent = node->parent != nullptr ? node->parent->ino - 1 : 0;
+
+		r.name_offset = (uint32_t) names.size();
+		r.name_size = (uint32_t) strlen(node->name);
+		names += node->name;
+		r.id = node->id;
+		r.is_dir = node->is_dir;
+		r.block = node->block;
+		r.block_offset = node->block_offset;
+		r.data_offset = node->data_offset;
+		r.size = node->size;
+		r.atime = node->atime.tv_sec;
+		r.atime_nsec = (uint32_t) node->atime.tv_nsec;
+		r.ctime = node->ctime.tv_sec;
+		r.ctime_nsec = (uint32_t) node->ctime.tv_nsec;
+		r.mtime = node->mtime.tv_sec;
+		r.mtime_nsec = (uint32_t) node->mtime.tv_nsec;
+		records.push_back(r);
+	}
+	// the records hold 32 bit offsets, which wrapped beyond this
+	if (records.size() > UINT32_MAX || names.size() > UINT32_MAX) {
+		LOG(WARNING) << "Index too large to save in " << path << Logger::endl;
+		return;
+	}
+	header.count = records.size();
+	header.names_size = names.size();
+
+	// written aside and renamed, concurrent mounts never see a partial file
+	std::string tmp = path + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if (fd < 0) {
+		LOG(WARNING) << "Can't save index in " << path << ": " << strerror(errno) << Logger::endl;
+		return;
+	}
+	FILE * f = fdopen(fd, "wb");
+	bool ok = f != nullptr
+		&& fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(records.data(), sizeof(Record), records.size(), f) == records.size()
+		&& fwrite(names.data(), 1, names.size(), f) == names.size();
+	if (f != nullptr) {
+		ok = (fclose(f) == 0) && ok;
+	}
+	else {
+		::close(fd);
+	}
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		LOG(WARNING) << "Can't save index in " << path << ": " << strerror(errno) << Logger::endl;
+		unlink(tmp.c_str());
+		return;
+	}
+	LOG(INFO) << "Index saved to " << path << Logger::endl;
+}
@@ -0,0 +1,102 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "node.h"
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Node tree of an archive saved next to the other mounts' ones, so the
+ * next mount of the same archive doesn't have to enumerate its items.
+ *
+ * The file is named after the archive path and is only trusted if the size,
+ * the mtime and a hash of the head and tail of the archive still match.
+ */
+class IndexCache
+{
+	public:
+	IndexCache(std::string const & dir, std::string const & archive);
+
+	/**
+	 * Rebuild the saved tree into the empty tree.
+	 * @return false if there is no usable saved index
+	 */
+	bool load(NodeTree & tree);
+
+	/**
+	 * Save the finalized tree, failures are only logged.
+	 */
+	void save(NodeTree & tree);
+
+	std::string const & filename() const
+	{
+		return path;
+	}
+
+	/**
+	 * Path of a file saved in dir for the archive, named after its path.
+	 */
+	static std::string saved(std::string const & dir, std::string const & archive, char const * extension);
+
+	/**
+	 * Size, mtime and hash of the head and tail of the archive, what is
+	 * saved for it is only valid as long as they match.
+	 * @return false if the archive can't be read
+	 */
+	static bool fingerprint(std::string const & archive, uint64_t & size, int64_t & mtime, uint64_t & hash);
+
+	private:
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t record_size;
+		uint64_t archive_size;
+		int64_t archive_mtime;
+		uint64_t archive_hash;
+		uint64_t count;
+		uint64_t names_size;
+	};
+
+	// one per node, in inode order
+	struct Record
+	{
+		uint64_t size;
+		uint64_t block_offset;
+		uint64_t data_offset;
+		int64_t atime;
+		int64_t ctime;
+		int64_t mtime;
+		uint32_t atime_nsec;
+		uint32_t ctime_nsec;
+		uint32_t mtime_nsec;
+		uint32_t parent;
+		uint32_t name_offset;
+		uint32_t name_size;
+		int32_t id;
+		int32_t block;
+		uint8_t is_dir;
+		uint8_t padding[7];
+	};
+
+	bool stamp(Header & header) const;
+
+	std::string const archive;
+	std::string const path;
+};
@@ -0,0 +1,120 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zpool.h"
+#include "logger.h"
+
+#include <sstream>
+#include <stdexcept>
+
+ArchivePool::ArchivePool(C7ZipLibrary & lib, std::string const & filename, unsigned int max_handles, open_t const & open,
+		bool map) :
+	lib(lib),
+	filename(filename),
+	max_handles(max_handles > 0 ? max_handles : 1),
+	open(open),
+	map(map),
+	opening(0)
+{
+	ArchiveHandle * handle = open_handle();
+	handles.push_back(handle);
+	idle.push_back(handle);
+}
+
+ArchivePool::~ArchivePool()
+{
+	close();
+}
+
+C7ZipArchive *
+ArchivePool::first()
+{
+	return handles.front()->archive;
+}
+
+ArchiveHandle *
+ArchivePool::open_handle()
+{
+	ArchiveHandle * handle = new ArchiveHandle;
+	try {
+		handle->stream = open ? open() : new Fuse7zInStream(filename, map);
+	}
+	catch (...) {
+		delete handle;
+		throw;
+	}
+	if (!lib.OpenArchive(handle->stream, &handle->archive)) {
+		delete handle->stream;
+		delete handle;
+		std::stringstream ss;
+		ss << "open archive " << filename << " failed" << std::endl;
+		throw std::runtime_error(ss.str());
+	}
+	return handle;
+}
+
+ArchiveHandle *
+ArchivePool::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (idle.empty()) {
+		if (handles.size() + opening < max_handles) {
+			++opening;
+			lock.unlock();
+			ArchiveHandle * handle;
+			try {
+				handle = open_handle();
+			}
+			catch (...) {
+				lock.lock();
+				--opening;
+				// a waiter may try in its place
+				cond.notify_one();
+				throw;
+			}
+			lock.lock();
+			--opening;
+			handles.push_back(handle);
+			LOG(DEBUG) << "Opened archive handle #" << handles.size() << Logger::endl;
+			return handle;
+		}
+		cond.wait(lock);
+	}
+	ArchiveHandle * handle = idle.back();
+	idle.pop_back();
+	return handle;
+}
+
+void
+ArchivePool::release(ArchiveHandle * handle)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	idle.push_back(handle);
+	cond.notify_one();
+}
+
+void
+ArchivePool::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < handles.size(); ++i) {
+		delete handles[i]->archive;
+		delete handles[i]->stream;
+		delete handles[i];
+	}
+	handles.clear();
+	idle.clear();
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "fuse7zstream.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <lib7zip.h>
+
+/**
+ * An opened archive with its own input stream. lib7zip archives are not
+ * reentrant, a handle is used by one extraction at a time.
+ */
+struct ArchiveHandle
+{
+	C7ZipInStream * stream;
+	C7ZipArchive * archive;
+};
+
+/**
+ * Bounded set of independently opened handles on the same archive, so
+ * extractions of different entries can run in parallel.
+ */
+class ArchivePool
+{
+	public:
+	typedef std::function<C7ZipInStream * ()> open_t;
+
+	/**
+	 * Opens the first handle right away, throws std::runtime_error if the
+	 * archive can't be opened.
+	 * @param open makes the input stream of a handle, the archive file
+	 *        is read with a Fuse7zInStream if empty
+	 * @param map the Fuse7zInStream maps the archive file
+	 */
+	ArchivePool(C7ZipLibrary & lib, std::string const & filename, unsigned int max_handles, open_t const & open = open_t(),
+			bool map = false);
+	~ArchivePool();
+
+	/**
+	 * The handle opened by the constructor, used to index the archive.
+	 */
+	C7ZipArchive * first();
+
+	/**
+	 * Take a free handle, opening a new one if the limit allows it or
+	 * waiting for one to be released otherwise. The opening is done
+	 * unlocked: a nested archive is opened by reading its outer entry.
+	 */
+	ArchiveHandle * acquire();
+
+	void release(ArchiveHandle * handle);
+
+	/**
+	 * Close every handle, none of them may be in use.
+	 */
+	void close();
+
+	private:
+	ArchiveHandle * open_handle();
+
+	C7ZipLibrary & lib;
+	std::string const filename;
+	unsigned int const max_handles;
+	open_t const open;
+	bool const map;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<ArchiveHandle *> handles;
+	std::vector<ArchiveHandle *> idle;
+	// handles being opened without the lock, they count against max_handles
+	unsigned int opening;
+};
+
+/**
+ * A handle taken from the pool for the lifetime of the lease.
+ */
+class ArchiveLease
+{
+	public:
+	ArchiveLease(ArchivePool & pool) :
+		pool(pool), handle(pool.acquire())
+	{
+	}
+
+	~ArchiveLease()
+	{
+		pool.release(handle);
+	}
+
+	ArchiveLease(ArchiveLease const &) = delete;
+	ArchiveLease & operator=(ArchiveLease const &) = delete;
+
+	C7ZipArchive * archive() const
+	{
+		return handle->archive;
+	}
+
+	private:
+	ArchivePool & pool;
+	ArchiveHandle * const handle;
+};
@@ -0,0 +1,192 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zprefetch.h"
+#include "logger.h"
+
+#include <algorithm>
+
+Fuse7zPrefetcher::Fuse7zPrefetcher(Fuse7zOptions const & options, Fuse7zCache & cache, unsigned int archive,
+		std::vector<Node *> const & items, extract_t const & extract) :
+	depth(options.prefetch),
+	// prefetched entries must not push each other out of the cache
+	window(std::min(options.prefetch_size, options.cache_size / 2)),
+	cache(cache),
+	archive(archive),
+	items(items),
+	extract(extract),
+	stopping(false),
+	ahead_size(0),
+	current(nullptr),
+	last(-1),
+	run_length(0),
+	hit_count(0),
+	miss_count(0)
+{
+}
+
+Fuse7zPrefetcher::~Fuse7zPrefetcher()
+{
+	stop();
+}
+
+bool
+Fuse7zPrefetcher::wanted(Node const * node) const
+{
+	// stored entries are read from the archive, empty ones cost nothing
+	return node != nullptr && !node->is_dir && node->size > 0 && node->data_offset == 0;
+}
+
+void
+Fuse7zPrefetcher::opened(Node * node)
+{
+	if (depth == 0 || node->id < 0) {
+		return;
+	}
+	int id = node->id;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (stopping) {
+		return;
+	}
+	// a forward step no longer than the prefetch depth, so that skipping
+	// directories or the odd file doesn't break the run
+	if (id > last && id <= last + 1 + (int)depth) {
+		++run_length;
+	}
+	else {
+		run_length = 0;
+	}
+	last = id;
+
+	std::map<int, unsigned long long>::iterator hit = ahead.find(id);
+	if (hit != ahead.end()) {
+		++hit_count;
+	}
+	else if (run_length > 0 && wanted(node)) {
+		++miss_count;
+	}
+	// the reader is past these, whatever became of them
+	while (!ahead.empty() && ahead.begin()->first <= id) {
+		ahead_size -= ahead.begin()->second;
+		ahead.erase(ahead.begin());
+	}
+	while (!queue.empty() && queue.front() <= id) {
+		queue.pop_front();
+	}
+
+	// the decoder goes through the whole solid block anyway: its next
+	// members are worth decoding ahead even on a first open
+	if (run_length == 0 && node->block < 0) {
+		return;
+	}
+	int next = ahead.empty() ? id + 1 : ahead.rbegin()->first + 1;
+	bool scheduled = false;
+	for (; next < (int)items.size() && ahead.size() < depth; ++next) {
+		Node * item = items[next];
+		if (!wanted(item)) {
+			continue;
+		}
+		if (run_length == 0 && item->block != node->block) {
+			break;
+		}
+		if (ahead_size + item->size > window) {
+			break;
+		}
+		ahead[next] = item->size;
+		ahead_size += item->size;
+		queue.push_back(next);
+		scheduled = true;
+	}
+	if (!scheduled) {
+		return;
+	}
+	// started here rather than in the constructor: the mount forks into
+	// the background after the file system is created
+	if (!worker.joinable()) {
+		worker = std::thread(&Fuse7zPrefetcher::run, this);
+	}
+	cond.notify_one();
+}
+
+void
+Fuse7zPrefetcher::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		cond.wait(lock, [this] { return stopping || !queue.empty(); });
+		if (stopping) {
+			return;
+		}
+		int id = queue.front();
+		queue.pop_front();
+		Node * node = items[id];
+
+		bool created;
+		Fuse7zOutStream * stream;
+		try {
+			stream = cache.acquire(Fuse7zCache::key(archive, id), node->size, node->block_offset, created);
+		}
+		catch (std::exception & e) {
+			LOG(WARNING) << "Prefetch of entry " << id << " failed: " << e.what() << Logger::endl;
+			continue;
+		}
+		if (created) {
+			LOG(DEBUG) << "Prefetching " << node->fullname() << Logger::endl;
+			current = stream;
+			lock.unlock();
+			extract(id, stream);
+			lock.lock();
+			current = nullptr;
+		}
+		// kept by the cache as an unused entry once complete
+		lock.unlock();
+		cache.release(Fuse7zCache::key(archive, id));
+		lock.lock();
+	}
+}
+
+void
+Fuse7zPrefetcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		queue.clear();
+		if (current != nullptr) {
+			// the worker is the decoder of this stream, cancel() doesn't wait
+			current->cancel();
+		}
+		cond.notify_all();
+	}
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+unsigned long long
+Fuse7zPrefetcher::hits()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return hit_count;
+}
+
+unsigned long long
+Fuse7zPrefetcher::misses()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return miss_count;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "node.h"
+#include "fuse7zcache.h"
+#include "options.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Decodes the next entries in archive order while a reader opens the files
+ * one after the other, so that their open() finds them in the cache. The
+ * open of a member of a solid block schedules the members after it.
+ *
+ * The extractions run one at a time on a worker of their own. Only a window
+ * of 'depth' entries and 'window' bytes ahead of the last open is kept
+ * decoded; the entries land in the cache, which evicts them like the others.
+ */
+class Fuse7zPrefetcher
+{
+	public:
+	typedef std::function<void (int, Fuse7zOutStream *)> extract_t;
+
+	/**
+	 * @param archive serial number of the archive, for the cache keys
+	 * @param items the nodes by archive item id, nullptr for the ids without one
+	 * @param extract decodes an item into a stream and finishes it
+	 */
+	Fuse7zPrefetcher(Fuse7zOptions const & options, Fuse7zCache & cache, unsigned int archive,
+			std::vector<Node *> const & items, extract_t const & extract);
+	~Fuse7zPrefetcher();
+
+	/**
+	 * Account an open of the node and schedule what follows it if the
+	 * opens look sequential.
+	 */
+	void opened(Node * node);
+
+	/**
+	 * Abort the running extraction and wait for the worker.
+	 */
+	void stop();
+
+	unsigned long long hits();
+	unsigned long long misses();
+
+	private:
+	/**
+	 * @return true for the entries worth decoding ahead
+	 */
+	bool wanted(Node const * node) const;
+
+	void run();
+
+	unsigned int const depth;
+	unsigned long long const window;
+	Fuse7zCache & cache;
+	unsigned int const archive;
+	std::vector<Node *> const & items;
+	extract_t const extract;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::thread worker;
+	bool stopping;
+	// item ids scheduled ahead of the reader, with their size
+	std::map<int, unsigned long long> ahead;
+	unsigned long long ahead_size;
+	std::deque<int> queue;
+	// the stream being decoded by the worker
+	Fuse7zOutStream * current;
+	// last id opened and number of sequential opens which led to it
+	int last;
+	unsigned int run_length;
+	unsigned long long hit_count;
+	unsigned long long miss_count;
+};
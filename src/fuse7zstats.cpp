@@ -0,0 +1,156 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zstats.h"
+
+#include <cstdio>
+
+Histogram::Histogram() :
+	count(0),
+	sum(0)
+{
+	for (int i = 0; i < BUCKETS; ++i) {
+		buckets[i] = 0;
+	}
+}
+
+void
+Histogram::add(unsigned long long us)
+{
+	int bucket = 0;
+	while (bucket < BUCKETS - 1 && us >= (1ULL << bucket)) {
+		++bucket;
+	}
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(us, std::memory_order_relaxed);
+}
+
+void
+Histogram::render(std::ostream & out) const
+{
+	out << "{\"count\":" << count.load(std::memory_order_relaxed)
+		<< ",\"sum_us\":" << sum.load(std::memory_order_relaxed)
+		<< ",\"buckets\":[";
+	bool first = true;
+	for (int i = 0; i < BUCKETS; ++i) {
+		unsigned long long n = buckets[i].load(std::memory_order_relaxed);
+		if (n == 0) {
+			continue;
+		}
+		out << (first ? "" : ",") << "[";
+		if (i < BUCKETS - 1) {
+			out << (1ULL << i);
+		}
+		else {
+			out << "null";
+		}
+		out << "," << n << "]";
+		first = false;
+	}
+	out << "]}";
+}
+
+Fuse7zStats::Fuse7zStats() :
+	extractions_running(0),
+	extractions_started(0),
+	extractions_failed(0),
+	bytes_decoded(0),
+	bytes_served(0),
+	cache_hits(0),
+	cache_misses(0),
+	stored_opens(0),
+	checkpointed_opens(0),
+	start(clock::now())
+{
+}
+
+void
+Fuse7zStats::extracted(std::string const & path, unsigned long long size, unsigned long long us, bool ok)
+{
+	extraction.add(us);
+	if (ok) {
+		bytes_decoded += size;
+	}
+	else {
+		++extractions_failed;
+	}
+
+	Extraction e = { path, size, us, ok };
+	std::lock_guard<std::mutex> lock(mutex);
+	if (recent.size() == RECENT) {
+		recent.pop_front();
+	}
+	recent.push_back(e);
+}
+
+void
+Fuse7zStats::render(std::ostream & out)
+{
+	out << "\"uptime_s\":" << std::chrono::duration_cast<std::chrono::seconds>(clock::now() - start).count()
+		<< ",\"extractions\":{\"running\":" << extractions_running
+		<< ",\"started\":" << extractions_started
+		<< ",\"failed\":" << extractions_failed
+		<< ",\"bytes_decoded\":" << bytes_decoded
+		<< ",\"latency_us\":";
+	extraction.render(out);
+	out << ",\"recent\":[";
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < recent.size(); ++i) {
+			Extraction const & e = recent[i];
+			out << (i ? "," : "") << "{\"path\":" << json_string(e.path)
+				<< ",\"bytes\":" << e.size
+				<< ",\"us\":" << e.us
+				<< ",\"ok\":" << (e.ok ? "true" : "false") << "}";
+		}
+	}
+	out << "]}"
+		<< ",\"opens\":{\"cache_hits\":" << cache_hits
+		<< ",\"cache_misses\":" << cache_misses
+		<< ",\"stored\":" << stored_opens
+		<< ",\"checkpointed\":" << checkpointed_opens << "}"
+		<< ",\"bytes_served\":" << bytes_served
+		<< ",\"latency_us\":{\"getattr\":";
+	getattr.render(out);
+	out << ",\"open\":";
+	open.render(out);
+	out << ",\"read\":";
+	read.render(out);
+	out << "}";
+}
+
+std::string
+json_string(std::string const & text)
+{
+	std::string quoted = "\"";
+	for (size_t i = 0; i < text.size(); ++i) {
+		unsigned char c = text[i];
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+			quoted += c;
+		}
+		else if (c < 0x20) {
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			quoted += escape;
+		}
+		else {
+			quoted += c;
+		}
+	}
+	return quoted + "\"";
+}
@@ -0,0 +1,130 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/**
+ * Latency distribution, bucket i counts the samples below 2^i microseconds.
+ */
+class Histogram
+{
+	public:
+	static const int BUCKETS = 26;
+
+	Histogram();
+
+	void add(unsigned long long us);
+
+	/**
+	 * {"count":..,"sum_us":..,"buckets":[[upper_us,count],..]}, empty
+	 * buckets left out, the last one is unbounded (null).
+	 */
+	void render(std::ostream & out) const;
+
+	private:
+	std::atomic<unsigned long long> buckets[BUCKETS];
+	std::atomic<unsigned long long> count;
+	std::atomic<unsigned long long> sum;
+};
+
+/**
+ * Counters of the mount, exported by the /.fuse7z/stats control file.
+ * Updated lock-free from the FUSE threads and the extraction workers.
+ */
+class Fuse7zStats
+{
+	public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * Adds the time it lived to a histogram.
+	 */
+	class Timer
+	{
+		public:
+		Timer(Histogram & histogram) :
+			histogram(histogram),
+			start(clock::now())
+		{
+		}
+
+		~Timer()
+		{
+			histogram.add(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count());
+		}
+
+		private:
+		Histogram & histogram;
+		clock::time_point start;
+	};
+
+	Fuse7zStats();
+
+	/**
+	 * Account a finished extraction.
+	 */
+	void extracted(std::string const & path, unsigned long long size, unsigned long long us, bool ok);
+
+	/**
+	 * The counters of this object as JSON members, without the braces.
+	 */
+	void render(std::ostream & out);
+
+	Histogram getattr;
+	Histogram open;
+	Histogram read;
+	Histogram extraction;
+
+	std::atomic<unsigned long long> extractions_running;
+	std::atomic<unsigned long long> extractions_started;
+	std::atomic<unsigned long long> extractions_failed;
+	std::atomic<unsigned long long> bytes_decoded;
+	std::atomic<unsigned long long> bytes_served;
+	// opens which found the entry decoded or being decoded, or had to start it
+	std::atomic<unsigned long long> cache_hits;
+	std::atomic<unsigned long long> cache_misses;
+	// opens served from the archive file directly
+	std::atomic<unsigned long long> stored_opens;
+	// opens of a gzip file, decoded from its checkpoints
+	std::atomic<unsigned long long> checkpointed_opens;
+
+	private:
+	struct Extraction
+	{
+		std::string path;
+		unsigned long long size;
+		unsigned long long us;
+		bool ok;
+	};
+	static const size_t RECENT = 32;
+
+	clock::time_point const start;
+	std::mutex mutex;
+	// the latest extractions, the most recent last
+	std::deque<Extraction> recent;
+};
+
+/**
+ * Quote a string for JSON.
+ */
+std::string json_string(std::string const & text);
@@ -0,0 +1,373 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zstored.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+static const size_t TAR_BLOCK = 512;
+
+static const uint32_t ZIP_LOCAL = 0x04034b50;
+static const uint32_t ZIP_CENTRAL = 0x02014b50;
+static const uint32_t ZIP_END = 0x06054b50;
+static const uint32_t ZIP64_END = 0x06064b50;
+static const uint32_t ZIP64_LOCATOR = 0x07064b50;
+// end of central directory record without the comment, and the longest comment
+static const size_t ZIP_END_SIZE = 22;
+static const size_t ZIP_COMMENT_MAX = 0xffff;
+
+static uint16_t
+le16 (unsigned char const * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+le32 (unsigned char const * p)
+{
+	return le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+static uint64_t
+le64 (unsigned char const * p)
+{
+	return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+/**
+ * Numeric tar field: octal text, or big-endian binary if the high bit of the
+ * first byte is set (GNU, for sizes of 8 GiB and more).
+ */
+static bool
+tar_number (unsigned char const * field, size_t size, unsigned long long & value)
+{
+	value = 0;
+	if (field[0] & 0x80) {
+		if (field[0] & 0x40) {
+			return false;
+		}
+		value = field[0] & 0x3f;
+		for (size_t i = 1; i < size; ++i) {
+			if (value >> 56) {
+				return false;
+			}
+			value = (value << 8) | field[i];
+		}
+		return true;
+	}
+	size_t i = 0;
+	while (i < size && field[i] == ' ') {
+		++i;
+	}
+	for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+		value = (value << 3) | (field[i] - '0');
+	}
+	return i == size || field[i] == ' ' || field[i] == '\0';
+}
+
+static std::string
+tar_string (unsigned char const * field, size_t size)
+{
+	char const * p = reinterpret_cast<char const *>(field);
+	return std::string(p, strnlen(p, size));
+}
+
+static bool
+tar_checksum (unsigned char const * header)
+{
+	unsigned long long expected;
+	if (!tar_number(header + 148, 8, expected)) {
+		return false;
+	}
+	unsigned long long sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK; ++i) {
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+	}
+	return sum == expected;
+}
+
+StoredScanner::StoredScanner(int fd, unsigned long long size) :
+	fd(fd),
+	length(size)
+{
+}
+
+bool
+StoredScanner::read(void * buf, size_t size, unsigned long long offset) const
+{
+	if (offset > length || size > length - offset) {
+		return false;
+	}
+	char * p = static_cast<char *>(buf);
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+size_t
+StoredScanner::scan(NodeTree & tree)
+{
+	unsigned char magic[4];
+	if (!read(magic, sizeof(magic), 0)) {
+		return 0;
+	}
+	if (le32(magic) == ZIP_LOCAL) {
+		return scan_zip(tree);
+	}
+	size_t count = scan_tar(tree);
+	// zips may start with something else, a self-extractor for example
+	return count > 0 ? count : scan_zip(tree);
+}
+
+bool
+StoredScanner::found(NodeTree & tree, std::string path, unsigned long long offset, unsigned long long size)
+{
+	// the same spelling as the items lib7zip reports
+	while (path.compare(0, 2, "./") == 0) {
+		path.erase(0, 2);
+	}
+	while (!path.empty() && path[0] == '/') {
+		path.erase(0, 1);
+	}
+	Node * node = tree.find(path.c_str());
+	if (node == nullptr || node->is_dir || node->size != size
+			|| offset == 0 || offset > length || size > length - offset) {
+		return false;
+	}
+	node->data_offset = offset;
+	return true;
+}
+
+size_t
+StoredScanner::scan_tar(NodeTree & tree)
+{
+	size_t count = 0;
+	unsigned char header[TAR_BLOCK];
+	// set by the GNU long name and the pax headers for the next entry
+	std::string next_path;
+	unsigned long long next_size = 0;
+	bool has_next_size = false;
+
+	unsigned long long offset = 0;
+	while (read(header, TAR_BLOCK, offset)) {
+		if (header[0] == '\0') {
+			break;
+		}
+		unsigned long long size;
+		if (!tar_checksum(header) || !tar_number(header + 124, 12, size)) {
+			if (offset > 0) {
+				LOG(WARNING) << "Unexpected tar header at " << offset << Logger::endl;
+			}
+			break;
+		}
+		unsigned long long data = offset + TAR_BLOCK;
+		char type = header[156];
+		if (type == 'L' || type == 'x') {
+			if (size > (1 << 20)) {
+				break;
+			}
+			std::vector<char> text(size);
+			if (!read(text.data(), size, data)) {
+				break;
+			}
+			if (type == 'L') {
+				next_path.assign(text.data(), strnlen(text.data(), size));
+			}
+			// pax records are "<length> <key>=<value>\n"
+			for (size_t pos = 0; type == 'x' && pos < size; ) {
+				char * end;
+				unsigned long record = strtoul(text.data() + pos, &end, 10);
+				if (record == 0 || pos + record > size || *end != ' ') {
+					break;
+				}
+				std::string entry(end + 1, text.data() + pos + record - 1);
+				if (entry.compare(0, 5, "path=") == 0) {
+					next_path = entry.substr(5);
+				}
+				else if (entry.compare(0, 5, "size=") == 0) {
+					next_size = strtoull(entry.c_str() + 5, nullptr, 10);
+					has_next_size = true;
+				}
+				pos += record;
+			}
+		}
+		else if (type == 'K' || type == 'g') {
+			// long link name, global pax header: nothing for the next entry
+		}
+		else {
+			if (has_next_size) {
+				size = next_size;
+			}
+			if (type == '0' || type == '\0' || type == '7') {
+				std::string path = next_path;
+				if (path.empty()) {
+					path = tar_string(header, 100);
+					std::string prefix = tar_string(header + 345, 155);
+					if (memcmp(header + 257, "ustar", 5) == 0 && !prefix.empty()) {
+						path = prefix + "/" + path;
+					}
+				}
+				if (found(tree, path, data, size)) {
+					++count;
+				}
+			}
+			next_path.clear();
+			has_next_size = false;
+		}
+		offset = data + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+	return count;
+}
+
+size_t
+StoredScanner::scan_zip(NodeTree & tree)
+{
+	if (length < ZIP_END_SIZE) {
+		return 0;
+	}
+	size_t tail_size = std::min<unsigned long long>(length, ZIP_END_SIZE + ZIP_COMMENT_MAX);
+	std::vector<unsigned char> tail(tail_size);
+	unsigned long long tail_offset = length - tail_size;
+	if (!read(tail.data(), tail_size, tail_offset)) {
+		return 0;
+	}
+	size_t end = tail_size - ZIP_END_SIZE;
+	while (le32(&tail[end]) != ZIP_END) {
+		if (end == 0) {
+			return 0;
+		}
+		--end;
+	}
+	unsigned char const * eocd = &tail[end];
+	unsigned long long end_offset = tail_offset + end;
+	if (le16(eocd + 4) != 0 || le16(eocd + 6) != 0) {
+		// spanned archive
+		return 0;
+	}
+	unsigned long long entries = le16(eocd + 10);
+	unsigned long long cd_size = le32(eocd + 12);
+	unsigned long long cd_offset = le32(eocd + 16);
+	// data prepended to the archive (self-extractors) shifts every offset
+	unsigned long long shift = 0;
+
+	if (entries == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) {
+		unsigned char locator[20];
+		unsigned char zip64[56];
+		if (end_offset < sizeof(locator)
+				|| !read(locator, sizeof(locator), end_offset - sizeof(locator))
+				|| le32(locator) != ZIP64_LOCATOR
+				|| !read(zip64, sizeof(zip64), le64(locator + 8))
+				|| le32(zip64) != ZIP64_END) {
+			return 0;
+		}
+		entries = le64(zip64 + 32);
+		cd_size = le64(zip64 + 40);
+		cd_offset = le64(zip64 + 48);
+	}
+	else if (cd_offset + cd_size < end_offset) {
+		shift = end_offset - cd_offset - cd_size;
+	}
+
+	std::vector<unsigned char> cd;
+	try {
+		cd.resize(cd_size);
+	}
+	catch (std::bad_alloc &) {
+		return 0;
+	}
+	if (!read(cd.data(), cd_size, cd_offset + shift)) {
+		return 0;
+	}
+
+	size_t count = 0;
+	size_t pos = 0;
+	for (unsigned long long i = 0; i < entries; ++i) {
+		if (pos + 46 > cd.size() || le32(&cd[pos]) != ZIP_CENTRAL) {
+			LOG(WARNING) << "Unexpected zip central directory entry " << i << Logger::endl;
+			break;
+		}
+		unsigned char const * h = &cd[pos];
+		uint16_t flags = le16(h + 8);
+		uint16_t method = le16(h + 10);
+		unsigned long long packed = le32(h + 20);
+		unsigned long long size = le32(h + 24);
+		size_t name_size = le16(h + 28);
+		size_t extra_size = le16(h + 30);
+		size_t comment_size = le16(h + 32);
+		unsigned long long local = le32(h + 42);
+		size_t next = pos + 46 + name_size + extra_size + comment_size;
+		if (next > cd.size()) {
+			break;
+		}
+
+		// zip64 extra field: the 64 bit values of the fields set to all ones
+		unsigned char const * extra = h + 46 + name_size;
+		for (size_t e = 0; e + 4 <= extra_size; ) {
+			size_t field_size = le16(extra + e + 2);
+			if (e + 4 + field_size > extra_size) {
+				break;
+			}
+			if (le16(extra + e) == 0x0001) {
+				unsigned char const * v = extra + e + 4;
+				unsigned char const * v_end = v + field_size;
+				if (size == 0xffffffff && v + 8 <= v_end) {
+					size = le64(v);
+					v += 8;
+				}
+				if (packed == 0xffffffff && v + 8 <= v_end) {
+					packed = le64(v);
+					v += 8;
+				}
+				if (local == 0xffffffff && v + 8 <= v_end) {
+					local = le64(v);
+				}
+			}
+			e += 4 + field_size;
+		}
+
+		std::string path(reinterpret_cast<char const *>(h + 46), name_size);
+		// stored, not encrypted, not a directory
+		if (method == 0 && (flags & 1) == 0 && packed == size
+				&& !path.empty() && path[path.size() - 1] != '/') {
+			unsigned char lh[30];
+			local += shift;
+			if (read(lh, sizeof(lh), local) && le32(lh) == ZIP_LOCAL) {
+				unsigned long long data = local + sizeof(lh) + le16(lh + 26) + le16(lh + 28);
+				if (found(tree, path, data, size)) {
+					++count;
+				}
+			}
+		}
+		pos = next;
+	}
+	return count;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "node.h"
+
+#include <string>
+
+/**
+ * Finds the entries of a tar or zip archive which are stored without
+ * compression nor encryption, their bytes can then be read straight from the
+ * archive file instead of being extracted.
+ *
+ * lib7zip doesn't tell where the data of an item is, so the headers of the
+ * two formats are walked here. Anything unexpected makes the scan give up,
+ * the entries are then simply extracted as usual.
+ */
+class StoredScanner
+{
+	public:
+	StoredScanner(int fd, unsigned long long size);
+
+	/**
+	 * Set Node::data_offset of the stored files of the finalized tree.
+	 * @return the number of such files
+	 */
+	size_t scan(NodeTree & tree);
+
+	private:
+	bool read(void * buf, size_t size, unsigned long long offset) const;
+
+	size_t scan_tar(NodeTree & tree);
+	size_t scan_zip(NodeTree & tree);
+
+	/**
+	 * Record an entry if the tree has a file of the same path and size.
+	 */
+	bool found(NodeTree & tree, std::string path, unsigned long long offset, unsigned long long size);
+
+	int fd;
+	unsigned long long length;
+};
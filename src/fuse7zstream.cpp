@@ -1 +1,438 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fuse7zstream.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// contiguous bytes read before the run is considered sequential
+static const unsigned long long int SEQUENTIAL_RUN = 1 << 20;
+// how far ahead of a sequential run the kernel is asked to read
+static const unsigned long long int READAHEAD_WINDOW = 8 << 20;
+
+Fuse7zOutStream::Fuse7zOutStream(BackingStore * store, bool complete) :
+	position(0),
+	written(complete ? store->size() : 0),
+	finished(complete),
+	failed(false),
+	cancelled(false),
+	store(store)
+{
+}
+
+Fuse7zOutStream::~Fuse7zOutStream()
+{
+	cancel();
+	delete store;
+}
+
+int
+Fuse7zOutStream::Write(const void *data, unsigned int size, unsigned int *processedSize)
+{
+	LOG(DEBUG) << "Write " << data << " size=" << size << " processed " << processedSize << Logger::endl;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (cancelled) {
+			return 1;
+		}
+	}
+	if (position + size > store->size()) {
+		LOG(ERROR) << "Write beyond the announced size " << store->size() << Logger::endl;
+		return 1;
+	}
+	// the range beyond 'written' is not touched by the readers
+	if (!store->write(data, size, position)) {
+		return 1;
+	}
+	*processedSize = size;
+	position += size;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (position > written) {
+		written = position;
+		cond.notify_all();
+	}
+	return 0;
+}
+
+int
+Fuse7zOutStream::Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition)
+{
+	LOG(DEBUG) << "Seek " << offset << " " << seekOrigin << Logger::endl;
+	long long int base;
+	switch (seekOrigin) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = position;
+			break;
+		case SEEK_END:
+			base = store->size();
+			break;
+		default:
+			return 1;
+	}
+	if (base + offset < 0) {
+		return 1;
+	}
+	position = base + offset;
+	if (newPosition) {
+		*newPosition = position;
+	}
+	return 0;
+}
+
+int
+Fuse7zOutStream::SetSize(unsigned long long int size)
+{
+	LOG(DEBUG) << "SetSize " << size << Logger::endl;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (size == store->size()) {
+		return 0;
+	}
+	if (written > 0) {
+		// readers may be copying out of the store
+		return 1;
+	}
+	try {
+		store->resize(size);
+	}
+	catch (std::exception & e) {
+		LOG(ERROR) << "SetSize failed: " << e.what() << Logger::endl;
+		return 1;
+	}
+	return 0;
+}
+
+void
+Fuse7zOutStream::finish(bool ok)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	finished = true;
+	failed = !ok;
+	cond.notify_all();
+}
+
+bool
+Fuse7zOutStream::complete()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return finished && !failed;
+}
+
+unsigned long long
+Fuse7zOutStream::size()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return store->size();
+}
+
+void
+Fuse7zOutStream::cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+	}
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+int
+Fuse7zOutStream::wait(size_t & size, off_t offset)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	unsigned long long int total = store->size();
+	if ((unsigned long long int)offset >= total) {
+		size = 0;
+		return 0;
+	}
+	if (size > total - offset) {
+		size = total - offset;
+	}
+	unsigned long long int end = offset + size;
+	cond.wait(lock, [&] { return written >= end || finished; });
+	if (written < end) {
+		if (failed || written <= (unsigned long long int)offset) {
+			return -EIO;
+		}
+		size = written - offset;
+	}
+	return 0;
+}
+
+int
+Fuse7zOutStream::read(char * buf, size_t size, off_t offset)
+{
+	// the count goes back as an int: a nested archive reader may ask for
+	// up to 4G at once, it gets a short read
+	size = std::min(size, (size_t) INT_MAX);
+	int err = wait(size, offset);
+	if (err != 0) {
+		return err;
+	}
+	// copy without blocking the decoder
+	if (size > 0 && !store->read(buf, size, offset)) {
+		return -EIO;
+	}
+	return (int) size;
+}
+
+Fuse7zInStream::Fuse7zInStream(std::string const & fileName, bool map) :
+	m_pMap(nullptr),
+	m_strFileName(fileName),
+	m_strFileExt(L"7z"),
+	m_nPosition(0),
+	m_nRunEnd(0),
+	m_nRunLength(0),
+	m_nPrefetched(0)
+{
+	struct stat st;
+	m_fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+		if (m_fd >= 0) {
+			::close(m_fd);
+		}
+		std::stringstream ss;
+		ss << "Can't open " << fileName;
+		throw std::runtime_error(ss.str());
+	}
+	m_nFileSize = st.st_size;
+
+	// the headers are looked up here and there, sequential runs get their
+	// readahead explicitly from advise()
+	if (map && m_nFileSize > 0 && m_nFileSize == (size_t)m_nFileSize) {
+		void * mapping = mmap(nullptr, m_nFileSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (mapping != MAP_FAILED) {
+			m_pMap = static_cast<char const *>(mapping);
+			madvise(mapping, m_nFileSize, MADV_RANDOM);
+		}
+	}
+	#if defined(POSIX_FADV_RANDOM)
+	posix_fadvise(m_fd, 0, 0, POSIX_FADV_RANDOM);
+	#endif
+
+	size_t pos = m_strFileName.find_last_of(".");
+	if (pos != m_strFileName.npos) {
+		m_strFileExt.resize(fileName.length() - pos - 1);
+		for (unsigned i = 0; i < m_strFileExt.length(); i++) {
+			m_strFileExt[i] = m_strFileName[pos+1+i];
+		}
+	}
+}
+
+Fuse7zInStream::~Fuse7zInStream()
+{
+	if (m_pMap) {
+		munmap(const_cast<char *>(m_pMap), m_nFileSize);
+	}
+	::close(m_fd);
+}
+
+std::wstring
+Fuse7zInStream::GetExt() const
+{
+	return m_strFileExt;
+}
+
+void
+Fuse7zInStream::advise(unsigned long long int offset, unsigned int size)
+{
+	if (offset == m_nRunEnd) {
+		m_nRunLength += size;
+	}
+	else {
+		m_nRunLength = size;
+		m_nPrefetched = 0;
+	}
+	m_nRunEnd = offset + size;
+
+	if (m_nRunLength < SEQUENTIAL_RUN || m_nRunEnd + READAHEAD_WINDOW / 2 < m_nPrefetched) {
+		return;
+	}
+	unsigned long long int start = m_nPrefetched > m_nRunEnd ? m_nPrefetched : m_nRunEnd;
+	if (start >= m_nFileSize) {
+		return;
+	}
+	unsigned long long int length = m_nRunEnd + READAHEAD_WINDOW - start;
+	if (m_pMap) {
+		long page = sysconf(_SC_PAGESIZE);
+		unsigned long long int aligned = start & ~(unsigned long long int)(page - 1);
+		if (aligned + length + (start - aligned) > m_nFileSize) {
+			length = m_nFileSize - start;
+		}
+		madvise(const_cast<char *>(m_pMap) + aligned, length + (start - aligned), MADV_WILLNEED);
+	}
+	#if defined(POSIX_FADV_WILLNEED)
+	else {
+		posix_fadvise(m_fd, start, length, POSIX_FADV_WILLNEED);
+	}
+	#endif
+	m_nPrefetched = start + length;
+}
+
+int
+Fuse7zInStream::Read(void *data, unsigned int size, unsigned int *processedSize)
+{
+	unsigned int count = 0;
+	if (m_nPosition < m_nFileSize) {
+		if (size > m_nFileSize - m_nPosition) {
+			size = (unsigned int) (m_nFileSize - m_nPosition);
+		}
+		advise(m_nPosition, size);
+		if (m_pMap) {
+			memcpy(data, m_pMap + m_nPosition, size);
+			count = size;
+		}
+		else {
+			while (count < size) {
+				ssize_t n = pread(m_fd, static_cast<char *>(data) + count, size - count, m_nPosition + count);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0) {
+					return 1;
+				}
+				if (n == 0) {
+					break;
+				}
+				count += (unsigned int) n;
+			}
+		}
+		m_nPosition += count;
+	}
+	if (processedSize != nullptr) {
+		*processedSize = count;
+	}
+	return 0;
+}
+
+int
+Fuse7zInStream::Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition)
+{
+	long long int base;
+	switch (seekOrigin) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = m_nPosition;
+			break;
+		case SEEK_END:
+			base = m_nFileSize;
+			break;
+		default:
+			return 1;
+	}
+	if (base + offset < 0) {
+		return 1;
+	}
+	m_nPosition = base + offset;
+	if (newPosition) {
+		*newPosition = m_nPosition;
+	}
+	return 0;
+}
+
+int
+Fuse7zInStream::GetSize(unsigned long long int * size)
+{
+	if (size)
+		*size = m_nFileSize;
+	return 0;
+}
+
+Fuse7zEntryInStream::Fuse7zEntryInStream(Fuse7zOutStream * stream, read_t const & read,
+		unsigned long long int size, std::wstring const & ext) :
+	m_pStream(stream),
+	m_read(read),
+	m_nSize(size),
+	m_nPosition(0),
+	m_strFileExt(ext)
+{
+}
+
+std::wstring
+Fuse7zEntryInStream::GetExt() const
+{
+	return m_strFileExt;
+}
+
+int
+Fuse7zEntryInStream::Read(void *data, unsigned int size, unsigned int *processedSize)
+{
+	unsigned int count = 0;
+	if (m_nPosition < m_nSize) {
+		if (size > m_nSize - m_nPosition) {
+			size = (unsigned int) (m_nSize - m_nPosition);
+		}
+		int n = m_pStream ? m_pStream->read(static_cast<char *>(data), size, m_nPosition)
+			: m_read(static_cast<char *>(data), size, m_nPosition);
+		if (n < 0) {
+			return 1;
+		}
+		count = n;
+	}
+	m_nPosition += count;
+	if (processedSize != nullptr) {
+		*processedSize = count;
+	}
+	return 0;
+}
+
+int
+Fuse7zEntryInStream::Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition)
+{
+	long long int base;
+	switch (seekOrigin) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = m_nPosition;
+			break;
+		case SEEK_END:
+			base = m_nSize;
+			break;
+		default:
+			return 1;
+	}
+	if (base + offset < 0) {
+		return 1;
+	}
+	m_nPosition = base + offset;
+	if (newPosition) {
+		*newPosition = m_nPosition;
+	}
+	return 0;
+}
+
+int
+Fuse7zEntryInStream::GetSize(unsigned long long int * size)
+{
+	if (size)
+		*size = m_nSize;
+	return 0;
+}
@@ -17,129 +17,156 @@
 #pragma once
 
 #include "logger.h"
+#include "fuse7zbacking.h"
 #include <lib7zip.h>
-#include <cstdio>
 #include <cstring>
 #include <vector>
-
-class Fuse7zOutStream : public C7ZipOutStream, public NodeBuffer //fuck
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+
+/**
+ * Decoded content of one archive entry.
+ *
+ * The extraction runs on a worker thread which feeds Write(), readers block in
+ * read() only until the range they ask for has been decoded.
+ */
+class Fuse7zOutStream : public C7ZipOutStream
 {
 	private:
 	unsigned long long int position;
+	unsigned long long int written;
+	bool finished;
+	bool failed;
+	bool cancelled;
 
-	public:
-	std::vector<char> buffer;
-
-	Fuse7zOutStream() : position(0) {
-	}
+	std::mutex mutex;
+	std::condition_variable cond;
 
-	virtual ~Fuse7zOutStream() {
-	}
-
-	virtual int Write(const void *data, unsigned int size, unsigned int *processedSize) {
-        Logger &logger = Logger::instance ();
-		logger << "Write " << data << " size=" << size << " processed " << processedSize << Logger::endl;
-		memcpy(&buffer[position], data, size);
-		*processedSize = size;
-		position += size;
-		return 0;
-	}
-
-	virtual int Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition) {
-        Logger &logger = Logger::instance ();
-		logger << "Seek " << offset << " " << seekOrigin << Logger::endl;
-		position = seekOrigin;
-		return 0;
-	}
+	BackingStore * store;
 
-	virtual int SetSize(unsigned long long int size) {
-        Logger &logger = Logger::instance ();
-		logger << "SetSize " << size << Logger::endl;
-		buffer.resize(size);
-		return 0;
+	public:
+	std::thread worker;
+
+	/**
+	 * @param store receives the decoded bytes, owned by the stream
+	 * @param complete the store already holds the whole entry, there is
+	 *        nothing to extract
+	 */
+	Fuse7zOutStream(BackingStore * store, bool complete = false);
+	virtual ~Fuse7zOutStream();
+
+	virtual int Write(const void *data, unsigned int size, unsigned int *processedSize);
+	virtual int Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition);
+	virtual int SetSize(unsigned long long int size);
+
+	/**
+	 * Mark the extraction as over, wake up the waiting readers.
+	 */
+	void finish(bool ok);
+
+	/**
+	 * @return true once the whole entry has been decoded successfully
+	 */
+	bool complete();
+
+	/**
+	 * @return the decoded size of the entry
+	 */
+	unsigned long long size();
+
+	/**
+	 * Abort the running extraction and wait for the worker.
+	 */
+	void cancel();
+
+	/**
+	 * Wait until [offset, offset+size) is decoded, size is shortened at EOF.
+	 * The store is not resized once data arrived, so the range stays valid
+	 * for as long as the stream.
+	 * @return 0 or -EIO
+	 */
+	int wait(size_t & size, off_t offset);
+
+	/**
+	 * Copy [offset, offset+size) into buf, waiting for the decoder if needed.
+	 * @return the number of bytes copied (short at EOF, at most INT_MAX) or -EIO
+	 */
+	int read(char * buf, size_t size, off_t offset);
+
+	BackingStore const * backing() const
+	{
+		return store;
 	}
 };
 
+/**
+ * Archive file read with pread(), or through a private mapping if asked to.
+ * Every instance has its own position, the handles of the pool read the
+ * same archive without sharing any state.
+ */
 class Fuse7zInStream : public C7ZipInStream
 {
 private:
-	FILE * m_pFile;
+	int m_fd;
+	char const * m_pMap;
 	std::string m_strFileName;
 	std::wstring m_strFileExt;
-	int m_nFileSize;
-public:
-	Fuse7zInStream(std::string const & fileName) : m_strFileName(fileName), m_strFileExt(L"7z") {
-
-		m_pFile = fopen(fileName.c_str(), "rb");
-		if (m_pFile) {
-			fseek(m_pFile, 0, SEEK_END);
-			m_nFileSize = ftell(m_pFile);
-			fseek(m_pFile, 0, SEEK_SET);
-			size_t pos = m_strFileName.find_last_of(".");
-			if (pos != m_strFileName.npos) {
-				m_strFileExt.resize(fileName.length() - pos);
-				for (unsigned i = 0; i < m_strFileExt.length(); i++) {
-					m_strFileExt[i] = m_strFileName[pos+1+i];
-				}
-			}
-		}
-		else {
-			std::stringstream ss;
-			ss << "Can't open " << fileName;
-			throw std::runtime_error(ss.str());
-		}
-	}
+	unsigned long long int m_nFileSize;
+	unsigned long long int m_nPosition;
+	// end of the current run of contiguous reads, its length, and how far
+	// the kernel has been told to read ahead
+	unsigned long long int m_nRunEnd;
+	unsigned long long int m_nRunLength;
+	unsigned long long int m_nPrefetched;
 
-	virtual ~Fuse7zInStream()
-	{
-		fclose(m_pFile);
-	}
+	void advise(unsigned long long int offset, unsigned int size);
 
 public:
-	virtual std::wstring GetExt() const
-	{
-		return m_strFileExt;
-	}
-
-	virtual int Read(void *data, unsigned int size, unsigned int *processedSize)
-	{
-		if (!m_pFile)
-			return 1;
-
-		int count = fread(data, 1, size, m_pFile);
-		if (count >= 0) {
-			if (processedSize != nullptr)
-				*processedSize = count;
-
-			return 0;
-		}
-
-		return 1;
-	}
-
-	virtual int Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition)
-	{
-		if (!m_pFile)
-			return 1;
-
-		int result = fseek(m_pFile, (long)offset, seekOrigin);
-
-		if (!result) {
-			if (newPosition)
-				*newPosition = ftell(m_pFile);
+	/**
+	 * @param map read through a mapping: fewer copies, but an archive
+	 *        truncated under the mount then kills it with SIGBUS
+	 */
+	Fuse7zInStream(std::string const & fileName, bool map = false);
+	virtual ~Fuse7zInStream();
+
+	virtual std::wstring GetExt() const;
+	virtual int Read(void *data, unsigned int size, unsigned int *processedSize);
+	virtual int Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition);
+	virtual int GetSize(unsigned long long int * size);
+};
 
-			return 0;
-		}
+/**
+ * An entry of another archive read as an archive: out of its decoded
+ * stream, waiting for the decoder where needed, or straight out of the outer
+ * archive if the entry is read without the cache.
+ */
+class Fuse7zEntryInStream : public C7ZipInStream
+{
+public:
+	// pread() like, short at the end of the entry or -errno
+	typedef std::function<int(char * buf, size_t size, off_t offset)> read_t;
 
-		return result;
-	}
+private:
+	Fuse7zOutStream * m_pStream;
+	read_t m_read;
+	unsigned long long int m_nSize;
+	unsigned long long int m_nPosition;
+	std::wstring m_strFileExt;
 
-	virtual int GetSize(unsigned long long int * size)
-	{
-		if (size)
-			*size = m_nFileSize;
-		return 0;
-	}
+public:
+	/**
+	 * @param stream decoded content of the entry, or nullptr to read it
+	 *        with read
+	 * @param ext extension of the entry, lib7zip picks the format by it
+	 */
+	Fuse7zEntryInStream(Fuse7zOutStream * stream, read_t const & read,
+			unsigned long long int size, std::wstring const & ext);
+
+	virtual std::wstring GetExt() const;
+	virtual int Read(void *data, unsigned int size, unsigned int *processedSize);
+	virtual int Seek(long long int offset, unsigned int seekOrigin, unsigned long long int *newPosition);
+	virtual int GetSize(unsigned long long int * size);
 };
-
-
@@ -36,17 +36,23 @@ inline Fuse7z *get_data ()
 }
 
 void *
-fuse7z_initlib (char const * archive, char const * cwd)
+fuse7z_initlib (char const * archive, char const * cwd, Fuse7zOptions const & options)
 {
-    void * lib = new Fuse7z(archive, cwd);
+    void * lib = new Fuse7z(archive, cwd, options);
     return lib;
 }
 
 void *
 fuse7z_init (struct fuse_conn_info *conn)
 {
-    (void) conn;
     Fuse7z *data = get_data();
+    // runs in the process which serves the mount, after the daemonization
+    Logger::instance().startWriter();
+    data->start();
+    // read_buf() hands out spill file descriptors, let libfuse splice them
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
     return data;
 }
 
@@ -55,50 +61,30 @@ fuse7z_destroy (void *_data)
 {
     Fuse7z *data = (Fuse7z *)_data;
     delete data;
-    Logger::instance() << "File system unmounted" << Logger::endl;
+    LOG(INFO) << "File system unmounted" << Logger::endl;
+    Logger::instance().stopWriter();
 }
 
 int
 fuse7z_getattr (const char *path, FUSE_STAT *stbuf)
 {
     Fuse7z *data = get_data();
+    Fuse7zStats::Timer timer(data->stats.getattr);
 
     if (*path == '\0') {
         return -ENOENT;
     }
 
-    Node * node = data->root_node->find(path + 1);
-    if (node == nullptr) {
+    // the directory of an archive of a multi-archive mount is enough,
+    // listing the mount root doesn't open all of them
+    Fuse7z::Pin found(*data, path + 1, false);
+    if (found.node == nullptr) {
         return -ENOENT;
     }
 
-    //Logger::instance() << "Getattr " << node->fullname() << Logger::endl;
-
-    memcpy(stbuf, &node->stat, sizeof(struct stat));
-
-    if (node->is_dir) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2 + node->childs.size();
-        stbuf->st_size = node->childs.size();
-    } else {
-        stbuf->st_mode = S_IFREG | 0644;
-        stbuf->st_nlink = 1;
-    }
-
-    stbuf->st_blksize = STANDARD_BLOCK_SIZE;
-    stbuf->st_blocks = (stbuf->st_size + STANDARD_BLOCK_SIZE - 1) / STANDARD_BLOCK_SIZE;
-    Logger::instance() << "stbuf->st_size " << stbuf->st_size << " = " << " stbuf->st_blocks " << stbuf->st_blocks << " * " << "stbuf->st_blksize " << stbuf->st_blksize << Logger::endl;
-    
-    
-    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
-    stbuf->st_uid = geteuid();
-    stbuf->st_gid = getegid();
-    #else
-    //TODO: should we really do it?
-    stbuf->st_uid = 0;
-    stbuf->st_gid = 0;
-    #endif
+    LOG(DEBUG) << "Getattr " << found.node->fullname() << Logger::endl;
 
+    data->getattr(found, stbuf);
     return 0;
 }
 
@@ -112,24 +98,39 @@ fuse7z_readdir (
 {
     Fuse7z *data = get_data();
 
-    if (*path == '\0') {
-        return -ENOENT;
-    }
-
-    //Logger::instance() << "Reading directory[" << path << "]" << Logger::endl;
-
-    Node * node = data->root_node->find(path + 1);
-    if (node == nullptr) {
-        return -ENOENT;
-    }
-
-    //Logger::instance().logger(node->fullname());
-
-    filler(buf, ".", nullptr, 0);
-    filler(buf, "..", nullptr, 0);
-    for (nodelist_t::const_iterator i = node->childs.begin(); i != node->childs.end(); ++i) {
-        Node * node = i->second;
-        filler(buf, node->name, nullptr, 0);
+    LOG(DEBUG) << "Reading directory[" << path << "] from " << offset << Logger::endl;
+
+    // resolved once by opendir for all the pages of the listing, which
+    // keeps the archive open
+    FileHandle * handle = (FileHandle *)fi->fh;
+    Node * node = handle->node;
+
+    // entry i is "." for 0, ".." for 1 and the child i - 2 after them; the
+    // children are a sorted array, so an offset resumes the listing in place
+    // and libfuse only ever buffers what fits in one reply
+    off_t count = 2 + node->child_count;
+    for (off_t i = offset; i < count; ++i) {
+        Node * entry;
+        char const * name;
+        if (i == 0) {
+            entry = node;
+            name = ".";
+        }
+        else if (i == 1) {
+            entry = node->parent ? node->parent : node;
+            name = "..";
+        }
+        else {
+            entry = node->childs[i - 2];
+            name = entry->name;
+        }
+
+        // the attributes come with the names, with -o use_ino the inodes too
+        struct stat st;
+        data->getattr(entry, &st, handle->slot);
+        if (filler(buf, name, &st, i + 1) != 0) {
+            break;
+        }
     }
 
     return 0;
@@ -142,32 +143,7 @@ fuse7z_statfs (
 {
     (void) path;
 
-    int err;
-    auto cwdStrPtr=get_data()->cwd.c_str();
-
-    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
-    struct statvfs st;
-    if ((err = statvfs(cwdStrPtr, &st)) != 0) {
-        return -err;
-    }
-    buf->f_bavail = buf->f_bfree = st.f_frsize * st.f_bavail;
-    #else
-    ULARGE_INTEGER f_avail, f_free;
-    GetDiskFreeSpaceExA(cwdStrPtr, nullptr, &f_avail, &f_free);
-    buf->f_bavail = buf->f_bfree = f_avail.QuadPart;
-    #endif
-    Logger::instance() << "buf->f_bavail " << buf->f_bavail << " buf->f_bfree " << buf->f_bfree << Logger::endl;
-   
-    buf->f_bsize = 1;
-    buf->f_blocks = buf->f_bavail + 0;
-
-    buf->f_ffree = 0;
-    buf->f_favail = 0;
-
-    buf->f_files = -1; // TODO get_data()->files.size() - 1;
-    buf->f_namemax = 255;
-
-    return 0;
+    return get_data()->statfs(buf);
 }
 
 int
@@ -179,17 +155,19 @@ fuse7z_open (
     if (*path == '\0') {
         return -ENOENT;
     }
-    Node *node = data->root_node->find(path + 1);
+    Fuse7z::Pin found(*data, path + 1);
+    Node *node = found.node;
     if (node == nullptr) {
         return -ENOENT;
     }
-    if (node->is_dir) {
+    if (data->is_dir(node)) {
         return -EISDIR;
     }
-    fi->fh = (uint64_t)node;
-
     try {
-        data->open(path, node);
+        fi->fh = (uint64_t)data->open(path, found);
+        // control files have no size, their content is made at open
+        fi->direct_io = data->is_control(node);
+        fi->keep_cache = data->keep_cache && !fi->direct_io;
         return 0;
     }
     catch (std::bad_alloc&) {
@@ -219,7 +197,19 @@ fuse7z_read (
         struct fuse_file_info   *fi)
 {
     Fuse7z *data = get_data();
-    return data->read(path, (Node*)fi->fh, buf, size, offset);
+    return data->read(path, (FileHandle*)fi->fh, buf, size, offset);
+}
+
+int
+fuse7z_read_buf (
+        const char              *path,
+        struct fuse_bufvec     **bufp,
+        size_t                   size,
+        off_t                    offset,
+        struct fuse_file_info   *fi)
+{
+    Fuse7z *data = get_data();
+    return data->read_buf(path, (FileHandle*)fi->fh, bufp, size, offset);
 }
 
 int
@@ -236,7 +226,7 @@ fuse7z_write (
 int fuse7z_release (const char *path, struct fuse_file_info *fi) {
     Fuse7z *data = get_data();
     try {
-        data->close(path, (Node*)fi->fh);
+        data->close(path, (FileHandle*)fi->fh);
         return 0;
     }
     catch(...) {
@@ -288,11 +278,11 @@ fuse7z_utimens (const char *path, const struct timespec tv[2])
     if (*path == '\0') {
         return -ENOENT;
     }
-    Node *node = data->root_node->find(path + 1);
-    if (node == nullptr) {
+    Fuse7z::Pin found(*data, path + 1, false);
+    if (found.node == nullptr) {
         return -ENOENT;
     }
-    node->stat.st_mtime = tv[1].tv_sec;
+    data->utimens(found.node, tv[1]);
     return 0;
 }
 
@@ -363,14 +353,32 @@ fuse7z_fsyncdir (const char *, int, struct fuse_file_info *)
 }
 
 int
-fuse7z_opendir (const char *, struct fuse_file_info *)
+fuse7z_opendir (const char *path, struct fuse_file_info *fi)
 {
-    return 0;
+    Fuse7z *data = get_data();
+    if (*path == '\0') {
+        return -ENOENT;
+    }
+    Fuse7z::Pin found(*data, path + 1);
+    if (found.node == nullptr) {
+        return -ENOENT;
+    }
+    if (!data->is_dir(found.node)) {
+        return -ENOTDIR;
+    }
+    try {
+        fi->fh = (uint64_t)data->opendir(found);
+        return 0;
+    }
+    catch (std::bad_alloc&) {
+        return -ENOMEM;
+    }
 }
 
 int
-fuse7z_releasedir (const char *, struct fuse_file_info *)
+fuse7z_releasedir (const char *path, struct fuse_file_info *fi)
 {
+    get_data()->close(path, (FileHandle*)fi->fh);
     return 0;
 }
 
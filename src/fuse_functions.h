@@ -18,7 +18,9 @@
 
 #include <fuse.h>
 
-void *fuse7z_initlib(char const * archive, char const * cwd);
+#include "options.h"
+
+void *fuse7z_initlib(char const * archive, char const * cwd, Fuse7zOptions const & options);
 void *fuse7z_init(struct fuse_conn_info *conn);
 void fuse7z_destroy(void *data);
 int fuse7z_getattr(const char *path, FUSE_STAT *stbuf);
@@ -27,6 +29,7 @@ int fuse7z_statfs(const char *path, struct statvfs *buf);
 int fuse7z_open(const char *path, struct fuse_file_info *fi);
 int fuse7z_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int fuse7z_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int fuse7z_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
 int fuse7z_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int fuse7z_release (const char *path, struct fuse_file_info *fi);
 int fuse7z_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
@@ -0,0 +1,331 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "fuse_lowlevel_functions.h"
+
+#include "node.h"
+#include "fuse7z.h"
+#include "logger.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+inline Fuse7z *get_data (fuse_req_t req)
+{
+    return (Fuse7z*) fuse_req_userdata(req);
+}
+
+void
+fuse7z_ll_init (void *data, struct fuse_conn_info *conn)
+{
+    // runs in the process which serves the mount, after the daemonization
+    Logger::instance().startWriter();
+    ((Fuse7z *) data)->start();
+    // read() hands out spill file descriptors, let libfuse splice them
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+}
+
+void
+fuse7z_ll_destroy (void *_data)
+{
+    Fuse7z *data = (Fuse7z *)_data;
+    delete data;
+    LOG(INFO) << "File system unmounted" << Logger::endl;
+    Logger::instance().stopWriter();
+}
+
+/**
+ * Entry of a node, as lookup replies it.
+ */
+static void
+fill_entry (Fuse7z *data, Node *node, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = node->ino;
+    e->entry_timeout = data->cache_timeout;
+    e->attr_timeout = data->cache_timeout;
+    data->getattr(node, &e->attr);
+}
+
+/**
+ * Reply a directory listing which fits in size bytes starting at offset,
+ * with the attributes of the entries.
+ */
+void
+fuse7z_ll_readdir (
+        fuse_req_t               req,
+        fuse_ino_t               ino,
+        size_t                   size,
+        off_t                    offset,
+        struct fuse_file_info   *fi)
+{
+    (void) fi;
+    Fuse7z *data = get_data(req);
+
+    Node * node = data->at(ino);
+    if (node == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!data->is_dir(node)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    data->wait_children(node);
+
+    LOG(DEBUG) << "Reading directory[" << node->fullname() << "] from " << offset << Logger::endl;
+
+    std::unique_ptr<char[]> buf(new (std::nothrow) char[size]);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // entry i is "." for 0, ".." for 1 and the child i - 2 after them, the
+    // offset handed back for an entry is the index of the next one
+    size_t used = 0;
+    off_t count = 2 + node->child_count;
+    for (off_t i = offset; i < count; ++i) {
+        Node * entry;
+        char const * name;
+        if (i == 0) {
+            entry = node;
+            name = ".";
+        }
+        else if (i == 1) {
+            entry = node->parent ? node->parent : node;
+            name = "..";
+        }
+        else {
+            entry = node->childs[i - 2];
+            name = entry->name;
+        }
+
+        // the attributes come with the names, with -o use_ino the inodes too
+        struct stat st;
+        data->getattr(entry, &st);
+        size_t len = fuse_add_direntry(req, buf.get() + used, size - used, name, &st, i + 1);
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf.get(), used);
+}
+
+void
+fuse7z_ll_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    Fuse7z *data = get_data(req);
+
+    Node * dir = data->at(parent);
+    if (dir == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!data->is_dir(dir)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    Node * node = data->child(dir, name, strlen(name));
+    if (node == nullptr) {
+        // an entry with inode 0 lets the kernel cache the miss
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = data->cache_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    LOG(DEBUG) << "Lookup " << node->fullname() << Logger::endl;
+
+    fill_entry(data, node, &e);
+    fuse_reply_entry(req, &e);
+}
+
+void
+fuse7z_ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    // nodes live as long as the mount, there is no lookup count to keep
+    (void) ino;
+    (void) nlookup;
+    fuse_reply_none(req);
+}
+
+void
+fuse7z_ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) fi;
+    Fuse7z *data = get_data(req);
+    Fuse7zStats::Timer timer(data->stats.getattr);
+
+    Node * node = data->at(ino);
+    if (node == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    LOG(DEBUG) << "Getattr " << node->fullname() << Logger::endl;
+
+    struct stat stbuf;
+    data->getattr(node, &stbuf);
+    fuse_reply_attr(req, &stbuf, data->cache_timeout);
+}
+
+void
+fuse7z_ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    Fuse7z *data = get_data(req);
+
+    Node * node = data->at(ino);
+    if (node == nullptr) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (data->is_dir(node)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    try {
+        Fuse7z::Pin pin(*data, node);
+        fi->fh = (uint64_t)data->open(node->name, pin);
+        // control files have no size, their content is made at open
+        fi->direct_io = data->is_control(node);
+        fi->keep_cache = data->keep_cache && !fi->direct_io;
+    }
+    catch (std::bad_alloc&) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    catch (std::runtime_error&) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+void
+fuse7z_ll_read (
+        fuse_req_t               req,
+        fuse_ino_t               ino,
+        size_t                   size,
+        off_t                    offset,
+        struct fuse_file_info   *fi)
+{
+    (void) ino;
+    Fuse7z *data = get_data(req);
+    FileHandle *handle = (FileHandle*)fi->fh;
+
+    struct fuse_bufvec *bufv;
+    int err = data->read_buf(handle->node->name, handle, &bufv, size, offset);
+    if (err != 0) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+    fuse_reply_data(req, bufv, (enum fuse_buf_copy_flags) 0);
+    free(bufv);
+}
+
+void
+fuse7z_ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    Fuse7z *data = get_data(req);
+    FileHandle *handle = (FileHandle*)fi->fh;
+    try {
+        data->close(handle->node->name, handle);
+        fuse_reply_err(req, 0);
+    }
+    catch(...) {
+        fuse_reply_err(req, ENOMEM);
+    }
+}
+
+void
+fuse7z_ll_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+    (void) ino;
+    struct statvfs buf;
+    memset(&buf, 0, sizeof(buf));
+
+    int err = get_data(req)->statfs(&buf);
+    if (err != 0) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+    fuse_reply_statfs(req, &buf);
+}
+
+int
+fuse7z_lowlevel_main (struct fuse_args *args, void *data)
+{
+    // the inodes of an archive closed and opened again may differ, the
+    // kernel would still hold the old ones
+    if (((Fuse7z *)data)->is_multi()) {
+        fprintf(stderr, "--lowlevel only mounts a single archive, without -o nested\n");
+        return -1;
+    }
+
+    struct fuse_lowlevel_ops fuse7z_ll_oper;
+    memset(&fuse7z_ll_oper, 0, sizeof(fuse7z_ll_oper));
+    fuse7z_ll_oper.init = fuse7z_ll_init;
+    fuse7z_ll_oper.destroy = fuse7z_ll_destroy;
+    fuse7z_ll_oper.lookup = fuse7z_ll_lookup;
+    fuse7z_ll_oper.forget = fuse7z_ll_forget;
+    fuse7z_ll_oper.getattr = fuse7z_ll_getattr;
+    fuse7z_ll_oper.readdir = fuse7z_ll_readdir;
+    fuse7z_ll_oper.open = fuse7z_ll_open;
+    fuse7z_ll_oper.read = fuse7z_ll_read;
+    fuse7z_ll_oper.release = fuse7z_ll_release;
+    fuse7z_ll_oper.statfs = fuse7z_ll_statfs;
+
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return -1;
+    }
+
+    int err = -1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    if (ch != nullptr) {
+        struct fuse_session *se = fuse_lowlevel_new(args,
+                &fuse7z_ll_oper, sizeof(fuse7z_ll_oper), data);
+        if (se != nullptr) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) != -1) {
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err;
+}
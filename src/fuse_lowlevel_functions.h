@@ -0,0 +1,43 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <fuse_lowlevel.h>
+
+/*
+ * Low-level frontend: requests carry inode numbers, which are the inodes of
+ * the NodeTree, so no path is ever built or looked up.
+ */
+void fuse7z_ll_init(void *data, struct fuse_conn_info *conn);
+void fuse7z_ll_destroy(void *data);
+void fuse7z_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void fuse7z_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+void fuse7z_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fuse7z_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+void fuse7z_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fuse7z_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+void fuse7z_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fuse7z_ll_statfs(fuse_req_t req, fuse_ino_t ino);
+
+/**
+ * Mount and serve the file system through the low-level API.
+ *
+ * @param args  the FUSE arguments left over by the option parsing
+ * @param data  the Fuse7z instance returned by fuse7z_initlib()
+ * @return 0 on a clean unmount
+ */
+int fuse7z_lowlevel_main(struct fuse_args *args, void *data);
@@ -17,14 +17,20 @@
 #include "config.h"
 #include "logger.h"
 #include <syslog.h>
+#include <chrono>
 #include <iostream>
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
 volatile bool win32SyslogInitialized = false;
 #endif
 
+std::atomic<int> Logger::s_level(Logger::L_INFO);
+
 Logger::Logger() :
-        m_syslog (false)
+        m_syslog (false),
+        m_async (false),
+        m_stop (false),
+        m_sleeping (false)
 {
     #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
     if(!win32SyslogInitialized){
@@ -32,12 +38,16 @@ Logger::Logger() :
         win32SyslogInitialized=true;
     }
     #endif
-	m_stream.str("");
+	m_tail = new Line;
+	m_tail->next = nullptr;
+	m_head = m_tail;
 	openlog(const_cast<char*>(PACKAGE), LOG_PID, LOG_USER);
 }
 
 Logger::~Logger()
 {
+	stopWriter();
+	delete m_tail;
 	closelog();
 }
 
@@ -48,6 +58,20 @@ Logger::instance ()
     return logger;
 }
 
+std::stringstream &
+Logger::stream ()
+{
+    static thread_local std::stringstream s;
+    return s;
+}
+
+Logger::Level &
+Logger::lineLevel ()
+{
+    static thread_local Level level = L_INFO;
+    return level;
+}
+
 void
 Logger::enableSyslog (bool enable)
 {
@@ -55,32 +79,143 @@ Logger::enableSyslog (bool enable)
 }
 
 void
-Logger::logger(std::string const & text)
+Logger::setLevel (Level level)
+{
+    s_level = level;
+}
+
+bool
+Logger::setLevel (std::string const & name)
+{
+    static char const * const names[] = { "error", "warning", "info", "debug" };
+    for (int i = L_ERROR; i <= L_DEBUG; ++i) {
+        if (name == names[i]) {
+            setLevel(static_cast<Level>(i));
+            return true;
+        }
+    }
+    return false;
+}
+
+Logger &
+Logger::begin (Level level)
+{
+    lineLevel() = level;
+    return *this;
+}
+
+void
+Logger::startWriter ()
+{
+    if (m_async) {
+        return;
+    }
+    m_stop = false;
+    m_writer = std::thread(&Logger::writer, this);
+    m_async = true;
+}
+
+void
+Logger::stopWriter ()
+{
+    if (!m_async) {
+        return;
+    }
+    // new lines are written synchronously, the writer drains the queue
+    m_async = false;
+    m_stop = true;
+    m_wake.notify_one();
+    m_writer.join();
+    // lines queued while the writer was exiting
+    while (Line * next = m_tail->next.load(std::memory_order_acquire)) {
+        write(next->level, next->text);
+        delete m_tail;
+        m_tail = next;
+    }
+}
+
+void
+Logger::submit (Level level, std::string const & text)
+{
+    Line * line = new Line;
+    line->level = level;
+    line->text = text;
+    line->next.store(nullptr, std::memory_order_relaxed);
+    Line * previous = m_head.exchange(line, std::memory_order_acq_rel);
+    previous->next.store(line, std::memory_order_release);
+    // a wake up lost to a race only delays the line until the writer's timeout
+    if (m_sleeping.load(std::memory_order_relaxed)) {
+        m_wake.notify_one();
+    }
+}
+
+void
+Logger::writer ()
+{
+    for (;;) {
+        Line * next = m_tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            write(next->level, next->text);
+            delete m_tail;
+            m_tail = next;
+            continue;
+        }
+        if (m_stop) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_sleeping = true;
+        if (m_tail->next.load(std::memory_order_acquire) == nullptr && !m_stop) {
+            m_wake.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        m_sleeping = false;
+    }
+}
+
+void
+Logger::write (Level level, std::string const & text)
 {
+	static int const priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+	std::lock_guard<std::mutex> lock(m_mutex);
 	if (m_syslog) {
-		syslog(LOG_INFO, "%s", text.c_str());
+		syslog(priorities[level], "%s", text.c_str());
+	}
+	else if (level == L_ERROR) {
+		std::cerr << text << std::endl;
 	}
 	else {
 		std::cerr << "fuse-7z: " << text << std::endl;
 	}
-	m_stream.str("");
+}
+
+void
+Logger::logger(std::string const & text)
+{
+	Level level = lineLevel();
+	if (m_async) {
+		submit(level, text);
+	}
+	else {
+		write(level, text);
+	}
+	stream().str("");
+	lineLevel() = L_INFO;
 }
 
 void
 Logger::err(std::string const & text)
 {
-	if (m_syslog) {
-		syslog(LOG_ERR, "%s", text.c_str());
+	if (m_async) {
+		submit(L_ERROR, text);
 	}
 	else {
-		std::cerr << text << std::endl;
+		write(L_ERROR, text);
 	}
 }
 
 Logger &
 Logger::endl (Logger &f)
 {
-	f.logger(f.m_stream.str());
+	f.logger(stream().str());
 	return f;
 }
-
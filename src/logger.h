@@ -16,22 +16,71 @@
  */
 #pragma once
 
+#include "config.h"
+
+#include <atomic>
+#include <condition_variable>
 #include <string>
 #include <sstream>
+#include <mutex>
+#include <thread>
+
+// most verbose level compiled in, the statements above it are dead code
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL L_DEBUG
+#endif
+
+/**
+ * Log a line if the level is enabled, otherwise nothing after the macro
+ * is evaluated:
+ *     LOG(DEBUG) << "Opening " << node->fullname() << Logger::endl;
+ */
+#define LOG(level) \
+    if (Logger::L_##level > Logger::LOG_MAX_LEVEL || !Logger::enabled(Logger::L_##level)) {} \
+    else Logger::instance().begin(Logger::L_##level)
 
 class Logger
 {
     public:
+        enum Level {
+            L_ERROR,
+            L_WARNING,
+            L_INFO,
+            L_DEBUG
+        };
+
         static Logger & instance ();
         ~Logger();
 
         void enableSyslog (bool enable = true);
 
+        static void setLevel (Level level);
+        /**
+         * @return false if the name is not a level
+         */
+        static bool setLevel (std::string const & name);
+
+        static bool enabled (Level level) {
+            return level <= s_level.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Hand the lines over to a writer thread from now on. Must be called
+         * after fuse has forked, threads don't survive it.
+         */
+        void startWriter ();
+        /**
+         * Flush the pending lines and write synchronously again.
+         */
+        void stopWriter ();
+
+        Logger & begin(Level level);
+
         void logger(std::string const & text);
         void err(std::string const & text);
         template<typename T>
             inline Logger & operator<<(T const & data) {
-                m_stream << data;
+                stream() << data;
                 return *this;
             }
         static Logger &endl(Logger &f);
@@ -45,8 +94,33 @@ class Logger
     private:
         Logger();
 
-        bool                m_syslog;
-        std::stringstream   m_stream;
-};
+        // every thread formats its own line, the extractions log too
+        static std::stringstream & stream();
+        static Level & lineLevel();
 
+        void submit(Level level, std::string const & text);
+        void write(Level level, std::string const & text);
+        void writer();
 
+        static std::atomic<int> s_level;
+
+        bool                m_syslog;
+        // keeps the lines of concurrent threads apart on stderr
+        std::mutex          m_mutex;
+
+        // multiple producers, single consumer queue of pending lines: the
+        // producers only swap the head, the writer owns the tail
+        struct Line {
+            Level level;
+            std::string text;
+            std::atomic<Line *> next;
+        };
+        std::atomic<Line *> m_head;
+        Line *              m_tail;
+        std::atomic<bool>   m_async;
+        std::atomic<bool>   m_stop;
+        std::atomic<bool>   m_sleeping;
+        std::mutex          m_wakeMutex;
+        std::condition_variable m_wake;
+        std::thread         m_writer;
+};
@@ -19,8 +19,11 @@
 #include <fuse.h>
 #include <fuse_opt.h>
 
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <climits>
 #include <unistd.h>
 
 #ifndef PATH_MAX
@@ -36,13 +39,14 @@
 
 #include "logger.h"
 #include "fuse_functions.h"
+#include "fuse_lowlevel_functions.h"
 
 /**
  * Print usage information
  */
 void print_usage()
 {
-    printf ("usage: fuse-7z-ng [options] <zip-file> <mountpoint>\n\n"
+    printf ("usage: fuse-7z-ng [options] <zip-file|directory> <mountpoint>\n\n"
             "general options:\n"
             "    -o opt,[opt...]        mount options\n"
             "    -h   --help            print help\n"
@@ -50,6 +54,41 @@ void print_usage()
             "    -r   -o ro             open archive in read-only mode\n"
             "    -f                     don't detach from terminal\n"
             "    -d                     turn on debugging, also implies -f\n"
+            "    -s                     disable multi-threaded operation\n"
+            "\n"
+            "fuse-7z-ng options:\n"
+            "    -o cache_size=N[KMG]   memory kept for decoded files after close (256M)\n"
+            "    -o compressed_cache=N[KMG]\n"
+            "                           memory for the files evicted from cache_size, kept\n"
+            "                           compressed (0: dropped)\n"
+            "    -o spill_threshold=N[KMG]\n"
+            "                           decode larger files to disk instead of memory (64M)\n"
+            "    -o spill_dir=DIR       directory of the spill files ($TMPDIR or /tmp)\n"
+            "    -o huge_pages          decode in memory into transparent huge pages\n"
+            "    -o archive_handles=N   archive handles for parallel extractions, 1-256 (4)\n"
+            "    -o mmap_archive        read the archive through a mapping, which fails hard\n"
+            "                           if it is truncated under the mount\n"
+            "    -o index_cache=DIR     save the archive index in DIR for faster remounts\n"
+            "    -o background_index    mount at once and index the archive meanwhile\n"
+            "    -o loglevel=LEVEL      error, warning, info (default) or debug\n"
+            "    -o cache_policy=P      kernel (default): the kernel keeps pages, attributes\n"
+            "                           and entries of the immutable archive; none: it doesn't\n"
+            "    -o cache_timeout=SECS  attribute and entry validity with cache_policy=kernel (86400)\n"
+            "    -o max_readahead=N[KMG]\n"
+            "                           readahead asked from the kernel (1M)\n"
+            "    -o prefetch=N          entries decoded ahead of sequential opens, 0 disables (2)\n"
+            "    -o prefetch_size=N[KMG]\n"
+            "                           bytes decoded ahead, at most half of cache_size (64M)\n"
+            "    -o archive_list        the source file lists the archives to mount, one per line\n"
+            "    -o index_memory=N[KMG] index memory of the archives of a directory or list,\n"
+            "                           and of the nested ones (256M)\n"
+            "    -o nested              browse the archives inside the archive as directories\n"
+            "    -o checkpoint_span=N[KMG]\n"
+            "                           decoded bytes between the checkpoints of a .gz file (1M)\n"
+            "    --lowlevel             serve requests by inode through the low-level API\n"
+            "\n"
+            "A directory or a list mounts each archive as a subdirectory, opened on first use.\n"
+            "The hidden file .fuse7z/stats of the mount holds its statistics as JSON.\n"
             "\n");
 }
 
@@ -77,14 +116,38 @@ struct fuse7z_param
     // verbosity
     int verbose;
     int automake;
+    // use the inode based low-level FUSE API
+    int lowlevel;
     char mountpoint[4096];
+    // tunables handed over to Fuse7z
+    Fuse7zOptions options;
 } param;
 
 enum key:uint8_t{
  KEY_HELP=0,
  KEY_VERSION=1,
  KEY_AUTO=2,
- KEY_SYSLOG=3
+ KEY_SYSLOG=3,
+ KEY_CACHE_SIZE=4,
+ KEY_SPILL_THRESHOLD=5,
+ KEY_SPILL_DIR=6,
+ KEY_ARCHIVE_HANDLES=7,
+ KEY_INDEX_CACHE=8,
+ KEY_LOGLEVEL=9,
+ KEY_LOWLEVEL=10,
+ KEY_CACHE_POLICY=11,
+ KEY_CACHE_TIMEOUT=12,
+ KEY_MAX_READAHEAD=13,
+ KEY_PREFETCH=14,
+ KEY_PREFETCH_SIZE=15,
+ KEY_ARCHIVE_LIST=16,
+ KEY_INDEX_MEMORY=17,
+ KEY_NESTED=18,
+ KEY_CHECKPOINT_SPAN=19,
+ KEY_COMPRESSED_CACHE=20,
+ KEY_HUGE_PAGES=21,
+ KEY_BACKGROUND_INDEX=22,
+ KEY_MMAP_ARCHIVE=23
 };
 
 static const struct fuse_opt fuse7z_opts[] =
@@ -95,9 +158,81 @@ static const struct fuse_opt fuse7z_opts[] =
     FUSE_OPT_KEY ("--version", KEY_VERSION),
     FUSE_OPT_KEY ("--automount", KEY_AUTO),
     FUSE_OPT_KEY ("--syslog", KEY_SYSLOG),
+    FUSE_OPT_KEY ("cache_size=", KEY_CACHE_SIZE),
+    FUSE_OPT_KEY ("spill_threshold=", KEY_SPILL_THRESHOLD),
+    FUSE_OPT_KEY ("spill_dir=", KEY_SPILL_DIR),
+    FUSE_OPT_KEY ("archive_handles=", KEY_ARCHIVE_HANDLES),
+    FUSE_OPT_KEY ("index_cache=", KEY_INDEX_CACHE),
+    FUSE_OPT_KEY ("loglevel=", KEY_LOGLEVEL),
+    FUSE_OPT_KEY ("--lowlevel", KEY_LOWLEVEL),
+    FUSE_OPT_KEY ("cache_policy=", KEY_CACHE_POLICY),
+    FUSE_OPT_KEY ("cache_timeout=", KEY_CACHE_TIMEOUT),
+    FUSE_OPT_KEY ("max_readahead=", KEY_MAX_READAHEAD),
+    FUSE_OPT_KEY ("prefetch=", KEY_PREFETCH),
+    FUSE_OPT_KEY ("prefetch_size=", KEY_PREFETCH_SIZE),
+    FUSE_OPT_KEY ("archive_list", KEY_ARCHIVE_LIST),
+    FUSE_OPT_KEY ("index_memory=", KEY_INDEX_MEMORY),
+    FUSE_OPT_KEY ("nested", KEY_NESTED),
+    FUSE_OPT_KEY ("checkpoint_span=", KEY_CHECKPOINT_SPAN),
+    FUSE_OPT_KEY ("compressed_cache=", KEY_COMPRESSED_CACHE),
+    FUSE_OPT_KEY ("huge_pages", KEY_HUGE_PAGES),
+    FUSE_OPT_KEY ("background_index", KEY_BACKGROUND_INDEX),
+    FUSE_OPT_KEY ("mmap_archive", KEY_MMAP_ARCHIVE),
     FUSE_OPT_KEY (nullptr, 0)
 };
 
+/**
+ * Parse a byte count with an optional K, M or G suffix.
+ *
+ * @return false if the text is not a valid size
+ */
+static bool
+parse_size (const char *text, unsigned long long *size)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'G': case 'g':
+            value <<= 10;
+            // fall through
+        case 'M': case 'm':
+            value <<= 10;
+            // fall through
+        case 'K': case 'k':
+            value <<= 10;
+            ++end;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *size = value;
+    return true;
+}
+
+/**
+ * Parse a decimal count in [min, max].
+ *
+ * @return false if the text is not a valid count
+ */
+static bool
+parse_count (const char *text, unsigned long min, unsigned long max, unsigned int *count)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || *text == '-' || value < min || value > max) {
+        return false;
+    }
+    *count = (unsigned int) value;
+    return true;
+}
+
 /**
  * Function to process arguments (called from fuse_opt_parse).
  *
@@ -144,6 +279,136 @@ process_arg (
             Logger::instance ().enableSyslog (true);
             return DISCARD;
 
+        case KEY_CACHE_SIZE:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.cache_size)) {
+                fprintf(stderr, "invalid cache_size: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_SPILL_THRESHOLD:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.spill_threshold)) {
+                fprintf(stderr, "invalid spill_threshold: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_SPILL_DIR:
+            param->options.spill_dir = strchr(arg, '=') + 1;
+            return DISCARD;
+
+        case KEY_ARCHIVE_HANDLES:
+            if (!parse_count(strchr(arg, '=') + 1, 1, 256, &param->options.archive_handles)) {
+                fprintf(stderr, "invalid archive_handles: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_INDEX_CACHE:
+            param->options.index_cache = strchr(arg, '=') + 1;
+            return DISCARD;
+
+        case KEY_LOGLEVEL:
+            if (!Logger::setLevel(strchr(arg, '=') + 1)) {
+                fprintf(stderr, "invalid loglevel: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_LOWLEVEL:
+            param->lowlevel = 1;
+            return DISCARD;
+
+        case KEY_CACHE_POLICY: {
+            const char *policy = strchr(arg, '=') + 1;
+            if (strcmp(policy, "kernel") == 0) {
+                param->options.cache_policy = CACHE_KERNEL;
+            }
+            else if (strcmp(policy, "none") == 0) {
+                param->options.cache_policy = CACHE_NONE;
+            }
+            else {
+                fprintf(stderr, "invalid cache_policy: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+        }
+
+        case KEY_CACHE_TIMEOUT: {
+            char *end;
+            param->options.cache_timeout = strtod(strchr(arg, '=') + 1, &end);
+            if (*end != '\0' || param->options.cache_timeout < 0) {
+                fprintf(stderr, "invalid cache_timeout: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+        }
+
+        case KEY_MAX_READAHEAD: {
+            unsigned long long size;
+            if (!parse_size(strchr(arg, '=') + 1, &size) || size > UINT_MAX) {
+                fprintf(stderr, "invalid max_readahead: %s\n", arg);
+                return ERROR;
+            }
+            param->options.max_readahead = (unsigned int) size;
+            return DISCARD;
+        }
+
+        case KEY_PREFETCH:
+            if (!parse_count(strchr(arg, '=') + 1, 0, UINT_MAX, &param->options.prefetch)) {
+                fprintf(stderr, "invalid prefetch: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_PREFETCH_SIZE:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.prefetch_size)) {
+                fprintf(stderr, "invalid prefetch_size: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_ARCHIVE_LIST:
+            param->options.archive_list = true;
+            return DISCARD;
+
+        case KEY_INDEX_MEMORY:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.index_memory)) {
+                fprintf(stderr, "invalid index_memory: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_NESTED:
+            param->options.nested = true;
+            return DISCARD;
+
+        case KEY_CHECKPOINT_SPAN:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.checkpoint_span) || param->options.checkpoint_span == 0) {
+                fprintf(stderr, "invalid checkpoint_span: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_COMPRESSED_CACHE:
+            if (!parse_size(strchr(arg, '=') + 1, &param->options.compressed_cache)) {
+                fprintf(stderr, "invalid compressed_cache: %s\n", arg);
+                return ERROR;
+            }
+            return DISCARD;
+
+        case KEY_HUGE_PAGES:
+            param->options.huge_pages = true;
+            return DISCARD;
+
+        case KEY_BACKGROUND_INDEX:
+            param->options.background_index = true;
+            return DISCARD;
+
+        case KEY_MMAP_ARCHIVE:
+            param->options.mmap_archive = true;
+            return DISCARD;
+
         case FUSE_OPT_KEY_NONOPT:
             ++param->strArgCount;
             switch (param->strArgCount) {
@@ -172,7 +437,7 @@ main (int argc, char **argv)
     void * data;
 
     char *mountpoint;
-    int multithreaded;  // this flag ignored because libzip does not supports multithreading
+    int multithreaded;
     int res;
     if (fuse_opt_parse (&args, &param, fuse7z_opts, (fuse_opt_proc_t)process_arg))
     {
@@ -201,7 +466,7 @@ main (int argc, char **argv)
         return 4;
     }
 
-    data = fuse7z_initlib (param.fileName, cwd);
+    data = fuse7z_initlib (param.fileName, cwd, param.options);
     if (! data )
     {
         fuse_opt_free_args(&args);
@@ -218,7 +483,32 @@ main (int argc, char **argv)
         
     }
 
+    // the library options come first, so that an explicit -o attr_timeout
+    // and the like still wins; use_ino keeps the inodes of the node tree,
+    // which readdir reports too
+    char cache_opts[256];
+    double timeout = param.options.cache_policy == CACHE_KERNEL ? param.options.cache_timeout : 0;
+    if (param.lowlevel) {
+        // the low-level frontend replies with its own timeouts
+        snprintf(cache_opts, sizeof(cache_opts), "-omax_readahead=%u",
+                param.options.max_readahead);
+    }
+    else {
+        snprintf(cache_opts, sizeof(cache_opts),
+                "-ouse_ino,entry_timeout=%g,negative_timeout=%g,attr_timeout=%g,max_readahead=%u",
+                timeout, timeout, timeout, param.options.max_readahead);
+    }
+    fuse_opt_insert_arg(&args, 1, cache_opts);
+
+    if (param.lowlevel)
+    {
+        res = fuse7z_lowlevel_main(&args, data);
+        fuse_opt_free_args(&args);
+        return (res == 0) ? 0 : 8;
+    }
+
     struct fuse_operations fuse7z_oper;
+    memset(&fuse7z_oper, 0, sizeof(fuse7z_oper));
     fuse7z_oper.init = fuse7z_init;
     fuse7z_oper.destroy = fuse7z_destroy;
     fuse7z_oper.readdir = fuse7z_readdir;
@@ -226,6 +516,7 @@ main (int argc, char **argv)
     fuse7z_oper.statfs = fuse7z_statfs;
     fuse7z_oper.open = fuse7z_open;
     fuse7z_oper.read = fuse7z_read;
+    fuse7z_oper.read_buf = fuse7z_read_buf;
     fuse7z_oper.write = fuse7z_write;
     fuse7z_oper.release = fuse7z_release;
     fuse7z_oper.unlink = fuse7z_unlink;
@@ -266,7 +557,12 @@ main (int argc, char **argv)
         return 7;
     }
 
-    res = fuse_loop(fuse);
+    if (multithreaded) {
+        res = fuse_loop_mt(fuse);
+    }
+    else {
+        res = fuse_loop(fuse);
+    }
 
     fuse_teardown(fuse, mountpoint);
 
@@ -16,6 +16,7 @@
  */
 #include "node.h"
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
 
@@ -23,121 +24,445 @@ using namespace std;
 
 const int Node::ROOT_NODE_INDEX = -1;
 const int Node::NEW_NODE_INDEX = -2;
-unsigned int Node::max_inode = 0u;
+const size_t NamePool::BLOCK_SIZE;
+const size_t NodeTree::CHUNK_SIZE;
 
-Node::Node (Node * parent, char const * name) :
-    sname(name),
-    is_dir(false),
-    parent(parent),
-    open_count(0),
-    state(CLOSED)
+static size_t
+hash_name (char const * name, size_t length)
 {
-    buffer = nullptr;
-    this->name = sname.c_str();
-    stat.st_ino = max_inode++;
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
 }
 
-Node::~Node()
-{
-    if (buffer)
-        delete buffer;
+static const uint64_t PATH_HASH_BASIS = 14695981039346656037ULL;
 
-    for (nodelist_t::iterator i = childs.begin(); i != childs.end(); i++) {
-        delete i->second;
+static uint64_t
+hash_path (char const * path, size_t length, uint64_t hash = PATH_HASH_BASIS)
+{
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
     }
-    childs.clear ();
+    return hash;
 }
 
-Node *
-Node::insert (char * path)
-{
-    //logger << "Inserting " << path << " in " << fullname() << "..." << Logger::endl;
-    char * path2 = path;
-    bool dir = false;
-    do {
-        if (*path2 == '/') {
-            dir = true;
-            *path2 = '\0';
-        }
-    } while(*path2++);
-
-    if (dir) {
-        nodelist_t::iterator i = childs.find(path);
-        if (i != childs.end())
-            return i->second->insert(path2);
-        // not found
-        //logger << "new subdir" << path << Logger::endl;
-        Node * child = new Node(this, path);
-        childs[child->name] = child;
-        child->is_dir = true;
-        return child->insert(path2);
-    }
-    else {
-        nodelist_t::iterator i = childs.find(path);
-        if (i != childs.end()) {
-            Node * child = i->second;
-            //logger << "When inserting " << path << " in " << fullname() << ", found that it already exists !" << Logger::endl;
-            return child;
-        }
-        //logger << "leaf " << path << Logger::endl;
-        Node * child = new Node(this, path);
-        childs[child->name] = child;
-        return child;
-    }
+static size_t
+hash_link (Node const * parent, char const * name)
+{
+    // names are interned, their address identifies them
+    size_t hash = (size_t)parent * 31 + (size_t)name;
+    return hash ^ (hash >> 17);
 }
 
 std::string
 Node::fullname() const
 {
     if (parent == nullptr) {
-        return sname;
+        return name;
     }
     if (parent->parent == nullptr) {
-        return sname;
+        return name;
     }
-    return parent->fullname() + "/" + sname;
+    return parent->fullname() + "/" + name;
+}
+
+bool
+Node::has_path(char const * path, size_t length) const
+{
+    Node const * node = this;
+    while (node->parent != nullptr) {
+        size_t n = strlen(node->name);
+        if (n > length || memcmp(path + length - n, node->name, n) != 0) {
+            return false;
+        }
+        length -= n;
+        node = node->parent;
+        if (node->parent != nullptr) {
+            if (length == 0 || path[length - 1] != '/') {
+                return false;
+            }
+            --length;
+        }
+    }
+    return length == 0;
+}
+
+Node *
+Node::child(char const * name, size_t length) const
+{
+    Node * const * first = childs;
+    size_t n = child_count;
+    while (n > 0) {
+        size_t half = n / 2;
+        Node * const * middle = first + half;
+        int cmp = strncmp((*middle)->name, name, length);
+        if (cmp == 0 && (*middle)->name[length] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return *middle;
+        }
+        if (cmp < 0) {
+            first = middle + 1;
+            n -= half + 1;
+        }
+        else {
+            n = half;
+        }
+    }
+    return nullptr;
 }
 
 Node *
 Node::find(char const * path)
 {
-    //logger << "Finding " << path << " from " << fullname() << Logger::endl;
-    if (*path == '\0') {
-        return this;
-    }
-
-    char const * path2 = path;
-    bool sub = false;
-    do {
-        if (*path2 == '/') {
-            sub = true;
-            break;
-        }
-    } while(*path2++);
-
-    if (sub) {
-        char pouet[255];
-        strncpy(pouet, path, path2-path);
-        pouet[path2-path] = '\0';
-        //cout << "Checking for " << pouet << " in subdirs..." << flush;
-        nodelist_t::iterator i = childs.find(pouet);
-        if (i != childs.end()) {
-            Node * child = i->second;
-            path2++;
-            //cout << " ok, looking for " << path2 << " in subdir " << child->name << endl;
-            return child->find(path2);
-        }
-        //cout << "no" << endl;
+    Node * node = this;
+    while (*path != '\0' && node != nullptr) {
+        char const * end = strchr(path, '/');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+        node = node->child(path, length);
+        path += length;
+        if (*path == '/') {
+            ++path;
+        }
+    }
+    return node;
+}
+
+void
+Node::fill_stat(struct stat * st) const
+{
+    st->st_ino = ino;
+    st->st_size = size;
+    st->st_atime = atime.tv_sec;
+    st->st_ctime = ctime.tv_sec;
+    st->st_mtime = mtime.tv_sec;
+    #if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+    st->st_atim.tv_nsec = atime.tv_nsec;
+    st->st_ctim.tv_nsec = ctime.tv_nsec;
+    st->st_mtim.tv_nsec = mtime.tv_nsec;
+    #endif
+}
+
+NamePool::NamePool() :
+    block_used(0),
+    block_size(0),
+    allocated(0),
+    table(1024, nullptr),
+    count(0)
+{
+}
+
+void
+NamePool::grow()
+{
+    std::vector<char const *> old(table.size() * 2, nullptr);
+    old.swap(table);
+    size_t mask = table.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+        if (old[i] == nullptr) {
+            continue;
+        }
+        size_t slot = hash_name(old[i], strlen(old[i])) & mask;
+        while (table[slot] != nullptr) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = old[i];
+    }
+}
+
+char const *
+NamePool::intern(char const * name, size_t length)
+{
+    size_t mask = table.size() - 1;
+    size_t slot = hash_name(name, length) & mask;
+    while (table[slot] != nullptr) {
+        if (strncmp(table[slot], name, length) == 0 && table[slot][length] == '\0') {
+            return table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (block_used + length + 1 > block_size) {
+        block_size = std::max(BLOCK_SIZE, length + 1);
+        blocks.push_back(std::unique_ptr<char[]>(new char[block_size]));
+        allocated += block_size;
+        block_used = 0;
+    }
+    char * copy = blocks.back().get() + block_used;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    block_used += length + 1;
+
+    table[slot] = copy;
+    if (++count * 2 > table.size()) {
+        grow();
+    }
+    return copy;
+}
+
+char const *
+NamePool::find(char const * name, size_t length) const
+{
+    size_t mask = table.size() - 1;
+    for (size_t slot = hash_name(name, length) & mask; table[slot] != nullptr; slot = (slot + 1) & mask) {
+        if (strncmp(table[slot], name, length) == 0 && table[slot][length] == '\0') {
+            return table[slot];
+        }
+    }
+    return nullptr;
+}
+
+size_t
+NamePool::memory() const
+{
+    return allocated + table.size() * sizeof(char const *);
+}
+
+NodeTree::NodeTree() :
+    count(0),
+    links(1024, nullptr),
+    link_count(0)
+{
+    Node * r = create(nullptr, names.intern("", 0));
+    r->is_dir = true;
+    r->id = Node::ROOT_NODE_INDEX;
+}
+
+Node *
+NodeTree::root()
+{
+    return &chunks[0][0];
+}
+
+Node *
+NodeTree::create(Node * parent, char const * name)
+{
+    if (count % CHUNK_SIZE == 0) {
+        chunks.push_back(std::unique_ptr<Node[]>(new Node[CHUNK_SIZE]));
+    }
+    Node * node = &chunks[count / CHUNK_SIZE][count % CHUNK_SIZE];
+    memset(node, 0, sizeof(Node));
+    ++count;
+    node->name = name;
+    node->parent = parent;
+    node->ino = (unsigned int) count;
+    node->id = Node::NEW_NODE_INDEX;
+    node->block = -1;
+    return node;
+}
+
+Node *
+NodeTree::linked(Node const * parent, char const * name) const
+{
+    size_t mask = links.size() - 1;
+    for (size_t slot = hash_link(parent, name) & mask; links[slot] != nullptr; slot = (slot + 1) & mask) {
+        if (links[slot]->parent == parent && links[slot]->name == name) {
+            return links[slot];
+        }
+    }
+    return nullptr;
+}
+
+void
+NodeTree::link(Node * node)
+{
+    if ((link_count + 1) * 2 > links.size()) {
+        std::vector<Node *> old(links.size() * 2, nullptr);
+        old.swap(links);
+        link_count = 0;
+        for (size_t i = 0; i < old.size(); ++i) {
+            if (old[i] != nullptr) {
+                link(old[i]);
+            }
+        }
+    }
+    size_t mask = links.size() - 1;
+    size_t slot = hash_link(node->parent, node->name) & mask;
+    while (links[slot] != nullptr) {
+        slot = (slot + 1) & mask;
+    }
+    links[slot] = node;
+    ++link_count;
+}
+
+Node *
+NodeTree::add_child(Node * parent, char const * name, size_t length)
+{
+    Node * child = create(parent, names.intern(name, length));
+    link(child);
+    return child;
+}
+
+Node *
+NodeTree::insert(char const * path, std::mutex * types)
+{
+    Node * node = root();
+    while (*path != '\0') {
+        char const * end = strchr(path, '/');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+        if (length > 0) {
+            char const * name = names.intern(path, length);
+            Node * child = linked(node, name);
+            if (child == nullptr) {
+                child = create(node, name);
+                link(child);
+            }
+            if (end != nullptr && !child->is_dir) {
+                // only directories have something below them
+                std::unique_lock<std::mutex> lock;
+                if (types != nullptr) {
+                    lock = std::unique_lock<std::mutex>(*types);
+                }
+                child->is_dir = true;
+            }
+            node = child;
+        }
+        path += length;
+        if (*path == '/') {
+            ++path;
+        }
+    }
+    return node;
+}
+
+Node *
+NodeTree::lookup(Node const * parent, char const * name, size_t length) const
+{
+    char const * interned = names.find(name, length);
+    return interned != nullptr ? linked(parent, interned) : nullptr;
+}
+
+Node *
+NodeTree::lookup(char const * path) const
+{
+    Node * node = &chunks[0][0];
+    while (*path != '\0' && node != nullptr) {
+        char const * end = strchr(path, '/');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+        if (length > 0) {
+            node = lookup(node, path, length);
+        }
+        path += length;
+        if (*path == '/') {
+            ++path;
+        }
+    }
+    return node;
+}
+
+void
+NodeTree::finalize()
+{
+    childs.clear();
+    childs.reserve(count - 1);
+    for (size_t i = 1; i < count; ++i) {
+        childs.push_back(&chunks[i / CHUNK_SIZE][i % CHUNK_SIZE]);
+    }
+    std::sort(childs.begin(), childs.end(), [] (Node const * a, Node const * b) {
+        if (a->parent != b->parent) {
+            return a->parent->ino < b->parent->ino;
+        }
+        return strcmp(a->name, b->name) < 0;
+    });
+    for (size_t i = 0; i < count; ++i) {
+        Node & node = chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+        node.childs = nullptr;
+        node.child_count = 0;
+    }
+    for (size_t i = 0; i < childs.size(); ++i) {
+        Node * parent = childs[i]->parent;
+        if (parent->child_count++ == 0) {
+            parent->childs = &childs[i];
+        }
+    }
+
+    std::vector<Node *>().swap(links);
+    link_count = 0;
+
+    // parents come before their children in the arena
+    size_t slots = 1024;
+    while (slots < count * 2) {
+        slots *= 2;
+    }
+    paths.assign(slots, 0);
+    std::vector<uint64_t> hashes(count);
+    hashes[0] = PATH_HASH_BASIS;
+    for (size_t i = 0; i < count; ++i) {
+        Node & node = chunks[i / CHUNK_SIZE][i % CHUNK_SIZE];
+        if (i > 0) {
+            uint64_t hash = hashes[node.parent->ino - 1];
+            if (node.parent->parent != nullptr) {
+                hash = hash_path("/", 1, hash);
+            }
+            hashes[i] = hash_path(node.name, strlen(node.name), hash);
+        }
+        size_t slot = hashes[i] & (slots - 1);
+        while (paths[slot] != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        paths[slot] = (hashes[i] & 0xffffffff00000000ULL) | node.ino;
+    }
+}
+
+Node *
+NodeTree::find(char const * path) const
+{
+    if (paths.empty()) {
         return nullptr;
     }
-    else {
-        nodelist_t::iterator i = childs.find(path);
-        if (i != childs.end()) {
-            Node * child = i->second;
-            return child;
+    size_t length = strlen(path);
+    uint64_t hash = hash_path(path, length);
+    size_t mask = paths.size() - 1;
+    for (size_t slot = hash & mask; paths[slot] != 0; slot = (slot + 1) & mask) {
+        if ((paths[slot] ^ hash) >> 32 != 0) {
+            continue;
         }
-        //cerr << "Child " << path << " not found in " << fullname() << " but it is not" << endl;
+        Node * node = at(paths[slot] & 0xffffffff);
+        if (node->has_path(path, length)) {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+Node *
+NodeTree::at(unsigned int ino) const
+{
+    if (ino == 0 || ino > count) {
         return nullptr;
     }
+    --ino;
+    return &chunks[ino / CHUNK_SIZE][ino % CHUNK_SIZE];
 }
 
+void
+NodeTree::clear()
+{
+    chunks.resize(1);
+    count = 1;
+    childs.clear();
+    Node * r = root();
+    r->childs = nullptr;
+    r->child_count = 0;
+    links.assign(1024, nullptr);
+    link_count = 0;
+    paths.clear();
+}
+
+size_t
+NodeTree::size() const
+{
+    return count;
+}
+
+size_t
+NodeTree::memory() const
+{
+    return chunks.size() * CHUNK_SIZE * sizeof(Node)
+        + names.memory()
+        + childs.capacity() * sizeof(Node *)
+        + paths.capacity() * sizeof(uint64_t);
+}
@@ -19,66 +19,174 @@
 #include <string>
 #include <cstring>
 
-#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
 #include <sys/stat.h>
-#include <map>
-
-class NodeBuffer
-{
-    public:
-        NodeBuffer() {}
-        virtual ~NodeBuffer() {}
-};
-
-struct ltstr
-{
-    bool operator() (const char* s1, const char* s2) const
-    {
-        return strcmp(s1, s2) < 0;
-    }
-};
-
-class Node;
-typedef std::map <const char *, Node*, ltstr> nodelist_t;
+#include <time.h>
 
+/**
+ * One entry of the archive.
+ *
+ * Nodes live in the arena of their NodeTree and are never freed one by one.
+ * The name points into the tree's string pool and the children of a
+ * directory are a sorted range of the tree's child array.
+ */
 class Node
 {
     public:
-        Node(Node * parent, char const * name);
-        ~Node();
-
         static const int ROOT_NODE_INDEX, NEW_NODE_INDEX;
 
     public:
-        NodeBuffer *buffer;
-
         char const *name;
-        std::string sname;
-        bool is_dir;
-        int id;
-        nodelist_t childs;
         Node *parent;
-        struct stat stat;
+        // sorted by name, valid once the tree is finalized
+        Node **childs;
+        unsigned int child_count;
+        unsigned int ino;
+        int id;
+        // solid block of the entry (-1 if none) and the decoded bytes before it
+        int block;
+        unsigned long long block_offset;
+        unsigned long long size;
+        // where the bytes of an entry stored uncompressed start in the
+        // archive file, 0 if it has to be extracted
+        unsigned long long data_offset;
+        struct timespec atime;
+        struct timespec ctime;
+        struct timespec mtime;
+        bool is_dir;
 
         std::string fullname() const;
 
-        void parse_name(char const *fname);
-        void attach();
+        /**
+         * @return true if fullname() would be the length bytes at path
+         */
+        bool has_path(char const * path, size_t length) const;
 
         Node * find(char const *);
-        Node * insert(char * leaf);
+
+        /**
+         * Binary search among the children.
+         */
+        Node * child(char const * name, size_t length) const;
+
+        /**
+         * Fill the fields of st the node knows about.
+         */
+        void fill_stat(struct stat * st) const;
+};
+
+/**
+ * Deduplicated storage of the names, the strings never move.
+ */
+class NamePool
+{
+    public:
+        NamePool();
+
+        char const * intern(char const * name, size_t length);
+
+        /**
+         * @return the interned copy of name, nullptr if there is none
+         */
+        char const * find(char const * name, size_t length) const;
+
+        /**
+         * Bytes allocated for the strings and the lookup table.
+         */
+        size_t memory() const;
 
     private:
-        static unsigned int max_inode;
+        static const size_t BLOCK_SIZE = 1 << 20;
 
-        enum nodeState {
-            CLOSED,
-            OPENED,
-            CHANGED,
-            NEW
-        };
+        void grow();
 
-        int open_count;
-        nodeState state;
+        std::vector<std::unique_ptr<char[]> > blocks;
+        size_t block_used;
+        size_t block_size;
+        size_t allocated;
+        // open addressing, power of two sized
+        std::vector<char const *> table;
+        size_t count;
 };
 
+/**
+ * Arena of the nodes of an archive.
+ *
+ * The tree is built with insert()/add_child(), then finalize() lays out the
+ * children as contiguous sorted ranges and hashes the full path of every
+ * node; the lookups only work after that.
+ */
+class NodeTree
+{
+    public:
+        NodeTree();
+
+        Node * root();
+
+        /**
+         * Add the entry at path, creating the missing parent directories.
+         * Returns the existing node if the path is already there.
+         * @param types held while an existing node turns into a directory,
+         *        if it may have been looked up already
+         */
+        Node * insert(char const * path, std::mutex * types = nullptr);
+
+        Node * add_child(Node * parent, char const * name, size_t length);
+
+        /**
+         * Look a child up while the tree is built, before finalize().
+         */
+        Node * lookup(Node const * parent, char const * name, size_t length) const;
+
+        /**
+         * Walk a full path (without the leading slash) through the nodes
+         * inserted so far, before finalize().
+         */
+        Node * lookup(char const * path) const;
+
+        void finalize();
+
+        /**
+         * Look a full path up (without the leading slash) with one probe of
+         * the path hash table.
+         */
+        Node * find(char const * path) const;
+
+        /**
+         * @return the node with the given inode number, nullptr if none
+         */
+        Node * at(unsigned int ino) const;
+
+        /**
+         * Drop every node but the root.
+         */
+        void clear();
+
+        size_t size() const;
+
+        /**
+         * Bytes used by the nodes, the names and the child ranges.
+         */
+        size_t memory() const;
+
+    private:
+        Node * create(Node * parent, char const * name);
+
+        static const size_t CHUNK_SIZE = 4096;
+
+        void link(Node * node);
+        Node * linked(Node const * parent, char const * name) const;
+
+        std::vector<std::unique_ptr<Node[]> > chunks;
+        size_t count;
+        NamePool names;
+        std::vector<Node *> childs;
+        // open addressing on the full path hash: (hash >> 32) << 32 | ino
+        std::vector<uint64_t> paths;
+        // build time only, children by (parent, interned name)
+        std::vector<Node *> links;
+        size_t link_count;
+};
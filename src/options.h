@@ -0,0 +1,98 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+
+/**
+ * What the kernel may cache of the mounted archive
+ */
+enum CachePolicy
+{
+    // every stat and every open reaches the file system
+    CACHE_NONE,
+    // the archive is immutable: pages survive reopens, attributes and
+    // entries (missing ones too) are kept for cache_timeout seconds
+    CACHE_KERNEL
+};
+
+/**
+ * Mount-time tunables, filled from the -o options in main()
+ */
+struct Fuse7zOptions
+{
+    // bytes of decoded entries kept around after their last release
+    unsigned long long cache_size;
+    // memory for the entries evicted from cache_size, kept compressed,
+    // 0 drops them
+    unsigned long long compressed_cache;
+    // entries larger than this are decoded into a file instead of memory
+    unsigned long long spill_threshold;
+    // where the spill files are created, $TMPDIR or /tmp if empty
+    std::string spill_dir;
+    // decode in memory into mappings the kernel may back with huge pages
+    bool huge_pages;
+    // archive handles opened for parallel extractions
+    unsigned int archive_handles;
+    // read the archive through a mapping rather than pread(), which a
+    // truncated archive turns into a SIGBUS
+    bool mmap_archive;
+    // directory of the saved indexes, indexes are not saved if empty
+    std::string index_cache;
+    // mount before the archive is indexed, lookups wait for what they need
+    bool background_index;
+    // kernel caching of pages, attributes and directory entries
+    CachePolicy cache_policy;
+    // seconds attributes and entries are valid in the kernel with CACHE_KERNEL
+    double cache_timeout;
+    // readahead asked from the kernel, which may grant less
+    unsigned int max_readahead;
+    // entries decoded ahead of a reader opening files in archive order, 0 to disable
+    unsigned int prefetch;
+    // bytes of entries decoded ahead of the reader, at most half the cache
+    unsigned long long prefetch_size;
+    // the source is a file listing the archives to mount, one per line
+    bool archive_list;
+    // bytes of indexes kept by the open archives of a multi-archive mount,
+    // the least recently used idle ones are closed beyond it
+    unsigned long long index_memory;
+    // browse the archives inside the archive as directories
+    bool nested;
+    // decoded bytes between two checkpoints of a gzip file, a read decodes
+    // at most this much before its offset
+    unsigned long long checkpoint_span;
+
+    Fuse7zOptions() :
+        cache_size(256ULL << 20),
+        compressed_cache(0),
+        spill_threshold(64ULL << 20),
+        huge_pages(false),
+        archive_handles(4),
+        mmap_archive(false),
+        background_index(false),
+        cache_policy(CACHE_KERNEL),
+        cache_timeout(86400),
+        max_readahead(1U << 20),
+        prefetch(2),
+        prefetch_size(64ULL << 20),
+        archive_list(false),
+        index_memory(256ULL << 20),
+        nested(false),
+        checkpoint_span(1ULL << 20)
+    {
+    }
+};
@@ -0,0 +1,92 @@
+/*
+ * This file is part of fuse-7z-ng.
+ *
+ * fuse-7z-ng is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fuse-7z-ng is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fuse-7z-ng.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * A tree loaded from the index cache has the inodes of the tree it was
+ * saved from.
+ */
+#include "fuse7zindex.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+int
+main ()
+{
+    char dir[] = "/tmp/fuse7z_index_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // only fingerprinted, the content doesn't matter
+    std::string archive = std::string(dir) + "/archive.7z";
+    FILE * f = fopen(archive.c_str(), "w");
+    if (f == nullptr || fputs("archive", f) < 0 || fclose(f) != 0) {
+        perror(archive.c_str());
+        return 1;
+    }
+
+    // the directories get more children after the ones of the next ones,
+    // a depth-first walk visits the nodes out of inode order
+    std::vector<std::string> paths;
+    for (int i = 0; i < 50; ++i) {
+        paths.push_back("d" + std::to_string(i % 7) + "/s" + std::to_string(i % 3) + "/f" + std::to_string(i));
+    }
+    paths.push_back("d1");
+    paths.push_back("top");
+
+    NodeTree fresh;
+    int id = 0;
+    for (std::string const & path : paths) {
+        Node * node = fresh.insert(path.c_str());
+        node->id = id++;
+    }
+    fresh.finalize();
+
+    IndexCache cache(dir, archive);
+    cache.save(fresh);
+    NodeTree loaded;
+    int failures = 0;
+    if (!cache.load(loaded)) {
+        fprintf(stderr, "the saved index doesn't load\n");
+        ++failures;
+    }
+    else if (loaded.size() != fresh.size()) {
+        fprintf(stderr, "%zu nodes loaded, %zu saved\n", loaded.size(), fresh.size());
+        ++failures;
+    }
+    else {
+        for (unsigned int ino = 2; ino <= fresh.size(); ++ino) {
+            std::string path = fresh.at(ino)->fullname();
+            Node const * node = loaded.find(path.c_str());
+            if (node == nullptr || node->ino != ino) {
+                fprintf(stderr, "%s: inode %u, %u once loaded\n", path.c_str(), ino, node ? node->ino : 0);
+                ++failures;
+            }
+        }
+    }
+
+    unlink(cache.filename().c_str());
+    unlink(archive.c_str());
+    rmdir(dir);
+    if (failures == 0) {
+        printf("%zu nodes keep their inodes\n", fresh.size());
+    }
+    return failures == 0 ? 0 : 1;
+}